@@ -137,6 +137,8 @@ cdr *cdr::get(void) {
         rec->cid = rec->sequence = 0;
         rec->starting = 0;
         rec->duration = 0;
+        memset(&rec->caller, 0, sizeof(rec->caller));
+        memset(&rec->callee, 0, sizeof(rec->callee));
         return rec;
     }
     private_lock.release();
@@ -109,9 +109,14 @@ void modules::cdrlog(FILE *fp, cdr *call)
     if(!fp || call->type != cdr::STOP)
         return;
 
-    fprintf(fp, "%08x:%u %s %s %s %ld %s %s %s %s\n",
+    // relayed media as packets/lost/jitter(usec) for caller then callee,
+    // ahead of the display name since that is free text and may have spaces
+    fprintf(fp, "%08x:%u %s %s %s %ld %s %s %s %lu/%lu/%lu %lu/%lu/%lu %s\n",
         call->sequence, call->cid, call->network, call->reason, buf,
-        call->duration, call->ident, call->dialed, call->joined, call->display);
+        call->duration, call->ident, call->dialed, call->joined,
+        call->caller.packets, call->caller.lost, call->caller.jitter,
+        call->callee.packets, call->callee.lost, call->callee.jitter,
+        call->display);
 }
 
 } // end namespace
@@ -61,6 +61,8 @@ voip::context_t service::callback::out_context = NULL;
 voip::context_t service::callback::tcp_context = NULL;
 voip::context_t service::callback::udp_context = NULL;
 voip::context_t service::callback::tls_context = NULL;
+voip::context_t *service::callback::udp_shards = NULL;
+unsigned service::callback::udp_count = 0;
 
 static struct sockaddr_storage peering;
 static time_t started = 0l;
@@ -159,6 +161,14 @@ service::callback::~callback()
     LinkedObject::delist(&runlevels[runlevel]);
 }
 
+voip::context_t service::callback::outbound(voip::context_t context, const struct sockaddr *peer)
+{
+    if(!peer || !udp_shards || context != udp_context)
+        return context;
+
+    return udp_shards[voip::shard(peer, udp_count)];
+}
+
 voip::context_t service::callback::getContext(const char *uri)
 {
     if(!uri)
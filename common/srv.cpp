@@ -420,7 +420,7 @@ voip::context_t srv::route(const char *uri, char *buf, size_t size)
 	else
 #endif
 		snprintf(buf, size, "%s:%s:%u", schema, host, (unsigned)ntohs(((struct sockaddr_in *)(entry))->sin_port) & 0xffff);
-    return ctx;
+    return service::callback::outbound(ctx, entry);
 }
 
 } // end namespace
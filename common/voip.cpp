@@ -19,10 +19,72 @@
 #include <ucommon/export.h>
 #include <sipwitch/voip.h>
 
+#if defined(SO_REUSEPORT) && defined(__linux__)
+#include <linux/filter.h>
+#endif
+
 namespace sipwitch {
 
 static int family = AF_INET;
 
+// Shards of a reuse port are picked by a hash of the peer address and port
+// rather than the kernel's own, so the server can tell which shard a peer's
+// replies will arrive on, and send its own requests to that peer from the
+// same shard.  The last word of the address is used for both families,
+// which is also the ipv4 address of a mapped ipv6 peer.
+
+#if defined(SO_ATTACH_REUSEPORT_CBPF)
+static bool steer(int so, unsigned count)
+{
+    struct sock_filter code[] = {
+        {BPF_LD | BPF_B | BPF_ABS, 0, 0, (uint32_t)SKF_NET_OFF},
+        {BPF_ALU | BPF_RSH | BPF_K, 0, 0, 4},
+        {BPF_JMP | BPF_JEQ | BPF_K, 4, 0, 6},
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)SKF_NET_OFF + 12},
+        {BPF_MISC | BPF_TAX, 0, 0, 0},
+        {BPF_LD | BPF_H | BPF_ABS, 0, 0, (uint32_t)SKF_NET_OFF + 20},
+        {BPF_JMP | BPF_JA, 0, 0, 3},
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, (uint32_t)SKF_NET_OFF + 20},
+        {BPF_MISC | BPF_TAX, 0, 0, 0},
+        {BPF_LD | BPF_H | BPF_ABS, 0, 0, (uint32_t)SKF_NET_OFF + 40},
+        {BPF_ALU | BPF_XOR | BPF_X, 0, 0, 0},
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, count},
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    struct sock_fprog prog;
+
+    prog.len = sizeof(code) / sizeof(code[0]);
+    prog.filter = code;
+    return setsockopt(so, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0;
+}
+#endif
+
+unsigned voip::shard(const struct sockaddr *peer, unsigned count)
+{
+    uint32_t addr = 0;
+    uint16_t port = 0;
+
+    if(!peer || count < 2)
+        return 0;
+
+    switch(peer->sa_family) {
+    case AF_INET:
+        addr = ntohl(((const struct sockaddr_in *)peer)->sin_addr.s_addr);
+        port = ntohs(((const struct sockaddr_in *)peer)->sin_port);
+        break;
+#ifdef  AF_INET6
+    case AF_INET6:
+        memcpy(&addr, &((const struct sockaddr_in6 *)peer)->sin6_addr.s6_addr[12], 4);
+        addr = ntohl(addr);
+        port = ntohs(((const struct sockaddr_in6 *)peer)->sin6_port);
+        break;
+#endif
+    default:
+        break;
+    }
+    return (addr ^ port) % count;
+}
+
 #ifdef	EXOSIP_API4
 
 bool voip::publish(voip::context_t ctx, const char *uri, const char *contact, const char *event, const char *duration, const char *type, const char *body)
@@ -426,6 +488,60 @@ bool voip::listen(context_t ctx, int proto, const char *addr, unsigned port, boo
     return true;
 }
 
+bool voip::listen_reuse(context_t ctx, const char *addr, unsigned port, unsigned count)
+{
+#if defined(SO_ATTACH_REUSEPORT_CBPF)
+    struct addrinfo hint, *list = NULL;
+    char svc[8];
+    int so, opt = 1;
+
+    if(!ctx)
+        return false;
+
+#ifdef  AF_INET6
+    if(family == AF_INET6 && addr && (!strcmp(addr, "::0") || !strcmp(addr, "::*")))
+        addr = NULL;
+#endif
+    if(addr && !strcmp(addr, "*"))
+        addr = NULL;
+
+    port = port & 0xfffe;
+    snprintf(svc, sizeof(svc), "%u", port);
+    memset(&hint, 0, sizeof(hint));
+    hint.ai_family = family;
+    hint.ai_socktype = SOCK_DGRAM;
+    hint.ai_protocol = IPPROTO_UDP;
+    hint.ai_flags = AI_PASSIVE;
+
+    if(getaddrinfo(addr, svc, &hint, &list) || !list)
+        return false;
+
+    so = ::socket(list->ai_family, SOCK_DGRAM, IPPROTO_UDP);
+    if(so < 0) {
+        freeaddrinfo(list);
+        return false;
+    }
+
+    // every shard binds the same port, and peers are spread over them
+    setsockopt(so, SOL_SOCKET, SO_REUSEADDR, (char *)&opt, sizeof(opt));
+    if(setsockopt(so, SOL_SOCKET, SO_REUSEPORT, (char *)&opt, sizeof(opt)) ||
+      ::bind(so, list->ai_addr, list->ai_addrlen) || !steer(so, count)) {
+        freeaddrinfo(list);
+        ::close(so);
+        return false;
+    }
+
+    freeaddrinfo(list);
+    if(eXosip_set_socket(ctx, IPPROTO_UDP, so, port)) {
+        ::close(so);
+        return false;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
 void voip::create(context_t *ctx, const char *agent, int f)
 {
     *ctx = eXosip_malloc();
@@ -853,6 +969,12 @@ bool voip::listen(context_t ctx, int proto, const char *addr, unsigned port, boo
     return true;
 }
 
+bool voip::listen_reuse(context_t ctx, const char *addr, unsigned port, unsigned count)
+{
+    // only one global context exists in older eXosip, so nothing to shard
+    return false;
+}
+
 void voip::create(context_t *ctx, const char *agent, int f)
 {
     if(active) {
@@ -111,6 +111,22 @@ public:
      */
     unsigned long duration;
 
+    /**
+     * Statistics for media relayed from one party of the call.
+     */
+    typedef struct {
+        unsigned long packets, bytes, lost;
+        unsigned long errors;   // relay errors, truncated or not sent
+        unsigned long jitter;   // interarrival jitter in usec
+        time_t last;            // time of last packet, 0 if none
+    } media_t;
+
+    /**
+     * Media sent by the calling and by the called party when relayed
+     * through our media proxy.
+     */
+    media_t caller, callee;
+
     /**
      * Get a free cdr node to fill from the cdr memory pool.  To maximize
      * performance and allow parallel operation a memory pool of cdr objects
@@ -73,8 +73,21 @@
 
 namespace sipwitch {
 
-#define CALL_MAP        "sipwitch.calls"
-#define REGISTRY_MAP    "sipwitch.regs"
+// the call and registry map names carry the record layout, so tools
+// built for an older layout find no map rather than misreading records.
+#define CALL_MAP        "sipwitch.calls.2"
+#define REGISTRY_MAP    "sipwitch.regs.2"
+#define LATENCY_MAP     "sipwitch.latency"
+
+#define LATENCY_BUCKETS 104     // to about 67 seconds
+
+#if defined(__GNUC__)
+#define MAPPED_BARRIER()    __sync_synchronize()
+#elif defined(_MSC_VER)
+#define MAPPED_BARRIER()    MemoryBarrier()
+#else
+#define MAPPED_BARRIER()
+#endif
 
 /**
  * User profiles are used to map features and toll restriction level together
@@ -97,6 +110,7 @@ class MappedRegistry : public LinkedObject
 public:
     typedef enum {OFFLINE = 0, IDLE, BUSY, AWAY, DND} status_t;
 
+    volatile uint32_t version;  // odd while being changed
     char    userid[MAX_USERID_SIZE];
     char    display[MAX_DISPLAY_SIZE];
     char    remote[MAX_USERID_SIZE];
@@ -147,6 +161,7 @@ public:
 class MappedCall : public LinkedObject
 {
 public:
+    volatile uint32_t version;  // odd while being changed
     time_t  created;
     time_t  active;
     char state[16];
@@ -157,6 +172,108 @@ public:
     int cid;
 };
 
+/**
+ * Latency histogram of one kind of server activity, kept in shared memory.
+ * Times are in microseconds.  Buckets are powers of two, each split into
+ * four linear steps, so any value is within 25% of its bucket.  Counters
+ * only grow, so a reader takes the difference of two samples for a period.
+ * @author David Sugar <dyfet@gnutelephony.org>
+ */
+class MappedLatency
+{
+public:
+    char id[24];
+    volatile unsigned long count;
+    volatile unsigned long max;
+    volatile uint64_t total;
+    volatile uint32_t buckets[LATENCY_BUCKETS];
+
+    /**
+     * Find the bucket a time falls in.
+     * @param usec to find bucket for.
+     * @return bucket index.
+     */
+    inline static unsigned bucket(unsigned long usec)
+    {
+        unsigned msb = 0;
+
+        if(usec < 4)
+            return (unsigned)usec;
+        while((usec >> msb) > 1)
+            ++msb;
+        msb = msb * 4 - 4 + (unsigned)((usec >> (msb - 2)) & 3);
+        return msb < LATENCY_BUCKETS ? msb : LATENCY_BUCKETS - 1;
+    }
+
+    /**
+     * Get the lowest time that falls in a bucket.
+     * @param index of bucket.
+     * @return time in microseconds.
+     */
+    inline static unsigned long floor(unsigned index)
+    {
+        if(index < 4)
+            return index;
+        unsigned msb = index / 4 + 1;
+        return (1ul << msb) + ((unsigned long)(index % 4) << (msb - 2));
+    }
+};
+
+/**
+ * Mark a mapped record as being changed.  The record version is made odd
+ * until the matching mapped_commit, and writers of the same record are
+ * serialized.  This is used by the server when updating shared memory.
+ * @param record to change.
+ */
+template <typename T>
+inline void mapped_modify(T *record)
+{
+    Mutex::protect(record);
+    ++record->version;
+    MAPPED_BARRIER();
+}
+
+/**
+ * Complete a change to a mapped record started with mapped_modify.
+ * @param record that was changed.
+ */
+template <typename T>
+inline void mapped_commit(T *record)
+{
+    MAPPED_BARRIER();
+    ++record->version;
+    Mutex::release(record);
+}
+
+/**
+ * Copy a consistent snapshot of a mapped record without server locks.
+ * The copy is retried while the server is changing the record, so a
+ * reader never sees a record that is half updated.
+ * @param record in shared memory to copy.
+ * @param buffer to copy into.
+ * @param retries before giving up on a busy record.
+ * @return true if a consistent copy was made.
+ */
+template <typename T>
+inline bool mapped_copy(const volatile T *record, T& buffer, unsigned retries = 100)
+{
+    uint32_t version;
+
+    while(retries--) {
+        version = record->version;
+        if(version & 1) {
+            Thread::yield();
+            continue;
+        }
+        MAPPED_BARRIER();
+        memcpy(&buffer, (const void *)record, sizeof(T));
+        MAPPED_BARRIER();
+        if(version == record->version)
+            return true;
+    }
+    return false;
+}
+
 } // namespace sipwitch
 
 #endif
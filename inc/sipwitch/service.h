@@ -234,6 +234,8 @@ public:
         static voip::context_t tcp_context;
         static voip::context_t udp_context;
         static voip::context_t tls_context;
+        static voip::context_t *udp_shards;
+        static unsigned udp_count;
 
         inline static void bind(unsigned short port)
             {sip_port = port;}
@@ -244,6 +246,15 @@ public:
         static void bind(const char *addr);
 
         voip::context_t getContext(const char *uri);
+
+        /**
+         * Select the udp shard a peer's replies arrive on, when the sip port
+         * is shared, for a request we originate toward that peer.
+         * @param context the request would otherwise be sent from.
+         * @param peer address of the request.
+         * @return context to send from.
+         */
+        static voip::context_t outbound(voip::context_t context, const struct sockaddr *peer);
     };
 
     service(const char *name, size_t s = 0);
@@ -123,6 +123,8 @@ public:
 	static void option(context_t ctx, int opt, const void *value);
 
 	static bool listen(context_t ctx, int proto = IPPROTO_UDP, const char *iface = NULL, unsigned port = 5060, bool tls = false);
+	static bool listen_reuse(context_t ctx, const char *iface = NULL, unsigned port = 5060, unsigned count = 2);
+	static unsigned shard(const struct sockaddr *peer, unsigned count);
 	static void create(context_t *ctx, const char *agent, int family = AF_INET);
 	static void release(context_t ctx);
 	static void show(msg_t msg);
@@ -0,0 +1,548 @@
+// Copyright (C) 2010-2014 David Sugar, Tycho Softworks.
+// Copyright (C) 2015 Cherokees of Idaho.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "server.h"
+
+#ifndef _MSWINDOWS_
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#endif
+
+namespace sipwitch {
+
+// The benchmark relays synthetic rtp streams through the media proxy on
+// loopback.  Each stream is set up through the sdp rewriter as a call
+// would be, with a generator socket as the sdp endpoint and a sink socket
+// latched as the far side.  Each generator thread sends one pcmu sized
+// packet on each of its streams every 20 msec, stamped with the time it
+// was sent, and a matching receiver thread collects them from the sinks.
+//
+// The contention benchmark maps synthetic registry entries and has each
+// thread drive the registry as the sip event threads do for REGISTER and
+// INVITE: one request in ten refreshes a random entry's registration, and
+// the rest dial a random entry and pin another as the caller, timing each
+// one.  It sweeps the thread count from 1 up to the given concurrency, and
+// runs each step with a single stripe, which is the old registry wide
+// lock, and with the configured stripes, so scaling can be compared.
+
+#define BENCH_PAYLOAD   160
+#define BENCH_INTERVAL  20
+#define BENCH_UPDATES   10
+
+#ifndef _MSWINDOWS_
+
+typedef struct {
+    socket_t source, sink;
+    struct sockaddr_storage proxy;
+    LinkedObject *nat;
+    uint16_t sequence, expected;
+    bool started;
+    unsigned long sent, received, gaps;
+} stream_t;
+
+static stream_t *streams = NULL;
+static unsigned scount = 0;
+static unsigned tcount = 1;
+static volatile bool sending = false;
+static volatile bool receiving = false;
+static Socket::address *contacts = NULL;
+
+static uint64_t usage(int who)
+{
+    struct rusage ru;
+
+    if(getrusage(who, &ru))
+        return 0;
+
+    return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000l +
+        (uint64_t)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+}
+
+static socket_t loopback(struct sockaddr_storage *addr)
+{
+    socklen_t len = sizeof(struct sockaddr_in);
+    struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+    socket_t so = ::socket(AF_INET, SOCK_DGRAM, 0);
+
+    if(so == INVALID_SOCKET)
+        return so;
+
+    memset(addr, 0, sizeof(struct sockaddr_storage));
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(::bind(so, (struct sockaddr *)sin, len) || ::getsockname(so, (struct sockaddr *)sin, &len)) {
+        Socket::release(so);
+        return INVALID_SOCKET;
+    }
+    return so;
+}
+
+static bool setup(stream_t *sp, unsigned id)
+{
+    char sdpin[256], sdpout[MAX_SDP_BUFFER];
+    struct sockaddr_storage source, sink, peering;
+    media::proxy *pp;
+
+    memset(sp, 0, sizeof(stream_t));
+    sp->source = loopback(&source);
+    sp->sink = loopback(&sink);
+    if(sp->source == INVALID_SOCKET || sp->sink == INVALID_SOCKET)
+        return false;
+
+    fcntl(sp->sink, F_SETFL, fcntl(sp->sink, F_GETFL) | O_NONBLOCK);
+
+    snprintf(sdpin, sizeof(sdpin),
+        "v=0\r\n"
+        "o=bench %u 1 IN IP4 127.0.0.1\r\n"
+        "s=-\r\n"
+        "c=IN IP4 127.0.0.1\r\n"
+        "t=0 0\r\n"
+        "m=audio %u RTP/AVP 0\r\n"
+        "a=rtcp-mux\r\n",
+        id, ntohs(((struct sockaddr_in *)&source)->sin_port));
+
+    memcpy(&peering, &source, sizeof(peering));
+    media::sdp parser(sdpin, sdpout, sizeof(sdpout));
+    parser.peering = (struct sockaddr *)&peering;
+    parser.nat = &sp->nat;
+    if(!parser.rewrite() || !sp->nat)
+        return false;
+
+    pp = (media::proxy *)sp->nat;
+    memcpy(&sp->proxy, &sink, sizeof(sp->proxy));
+    ((struct sockaddr_in *)&sp->proxy)->sin_port = htons(pp->port);
+
+    // the first packet from the sink makes it the far side of the proxy
+    return ::sendto(sp->sink, "", 1, 0, (struct sockaddr *)&sp->proxy, sizeof(struct sockaddr_in)) == 1;
+}
+
+bench::bench(unsigned id, kind_t type) : JoinableThread()
+{
+    index = id;
+    kind = type;
+    cpu = 0;
+    max = ops = 0;
+    memset(buckets, 0, sizeof(buckets));
+}
+
+void bench::run(void)
+{
+    switch(kind) {
+    case SEND:
+        send();
+        break;
+    case RECEIVE:
+        receive();
+        break;
+    case SIGNAL:
+        signalling();
+        break;
+    }
+
+#ifdef  RUSAGE_THREAD
+    cpu = usage(RUSAGE_THREAD);
+#endif
+}
+
+void bench::send(void)
+{
+    uint8_t packet[12 + BENCH_PAYLOAD];
+    uint64_t now, next = latency::now();
+    stream_t *sp;
+    uint32_t stamp;
+
+    memset(packet, 0, sizeof(packet));
+    packet[0] = 0x80;
+
+    while(sending) {
+        for(unsigned id = index; id < scount; id += tcount) {
+            sp = &streams[id];
+            stamp = (uint32_t)sp->sequence * BENCH_PAYLOAD;
+            packet[2] = (uint8_t)(sp->sequence >> 8);
+            packet[3] = (uint8_t)(sp->sequence);
+            packet[4] = (uint8_t)(stamp >> 24);
+            packet[5] = (uint8_t)(stamp >> 16);
+            packet[6] = (uint8_t)(stamp >> 8);
+            packet[7] = (uint8_t)(stamp);
+            packet[8] = (uint8_t)(id >> 24);
+            packet[9] = (uint8_t)(id >> 16);
+            packet[10] = (uint8_t)(id >> 8);
+            packet[11] = (uint8_t)(id);
+            now = latency::now();
+            memcpy(packet + 12, &now, sizeof(now));
+            if(::sendto(sp->source, packet, sizeof(packet), 0,
+              (struct sockaddr *)&sp->proxy, sizeof(struct sockaddr_in)) > 0)
+                ++sp->sent;
+            ++sp->sequence;
+        }
+
+        next += BENCH_INTERVAL * 1000000l;
+        now = latency::now();
+        if(next > now)
+            Thread::sleep((timeout_t)((next - now) / 1000000l));
+    }
+}
+
+void bench::receive(void)
+{
+    uint8_t packet[12 + BENCH_PAYLOAD + 16];
+    unsigned count = 0, pos;
+    struct pollfd *fds = new struct pollfd[scount / tcount + 1];
+    stream_t **map = new stream_t *[scount / tcount + 1];
+    stream_t *sp;
+    uint64_t sent, now;
+    unsigned long usec;
+    uint16_t seq, gap;
+    ssize_t len;
+
+    for(unsigned id = index; id < scount; id += tcount) {
+        fds[count].fd = streams[id].sink;
+        fds[count].events = POLLIN;
+        map[count++] = &streams[id];
+    }
+
+    while(receiving) {
+        if(poll(fds, count, 100) < 1)
+            continue;
+
+        for(pos = 0; pos < count; ++pos) {
+            if(!(fds[pos].revents & POLLIN))
+                continue;
+
+            sp = map[pos];
+            while((len = ::recv(sp->sink, packet, sizeof(packet), 0)) > 0) {
+                now = latency::now();
+                if(len < 12 + (ssize_t)sizeof(sent))
+                    continue;
+
+                memcpy(&sent, packet + 12, sizeof(sent));
+                usec = (unsigned long)((now - sent) / 1000l);
+                ++buckets[MappedLatency::bucket(usec)];
+                if(usec > max)
+                    max = usec;
+
+                ++sp->received;
+                seq = ((uint16_t)packet[2] << 8) | packet[3];
+                if(sp->started) {
+                    gap = (uint16_t)(seq - sp->expected);
+                    if(gap >= 0x8000)
+                        continue;
+                    sp->gaps += gap;
+                }
+                sp->started = true;
+                sp->expected = seq + 1;
+            }
+        }
+    }
+
+    delete[] fds;
+    delete[] map;
+}
+
+void bench::signalling(void)
+{
+    char id[MAX_USERID_SIZE], contact[MAX_URI_SIZE];
+    uint32_t seed = index * 2654435761u + 1;
+    registry::mapped *rr, *target;
+    uint64_t started;
+    unsigned long nsec;
+    unsigned entry;
+    time_t now;
+
+    while(sending) {
+        seed = seed * 1103515245u + 12345u;
+        entry = (seed >> 8) % scount;
+        snprintf(id, sizeof(id), "bench%u", entry);
+        started = latency::now();
+        if(!((seed >> 4) % BENCH_UPDATES)) {
+            snprintf(contact, sizeof(contact), "sip:%s@127.0.0.1:%u", id, 1024 + entry % 60000);
+            rr = registry::allocate(id);
+            if(rr) {
+                time(&now);
+                if(!rr->refresh(contacts[entry], now + 300, contact))
+                    rr->addTarget(contacts[entry], now + 300, contact, "local",
+                        (struct sockaddr *)contacts[entry].getAddr(), NULL);
+                registry::detach(rr);
+            }
+        }
+        else {
+            target = registry::dialing(id);
+            snprintf(id, sizeof(id), "bench%u", (seed >> 16) % scount);
+            rr = registry::invite(id, stats::INCOMING);
+            if(rr)
+                registry::decUse(rr, stats::INCOMING);
+            registry::detach(target);
+        }
+        nsec = (unsigned long)(latency::now() - started);
+
+        ++ops;
+        ++buckets[MappedLatency::bucket(nsec / 1000l)];
+        if(nsec > max)
+            max = nsec;
+    }
+}
+
+static unsigned long percentile(unsigned long *buckets, unsigned long total, unsigned percent)
+{
+    unsigned long sum = 0, limit = (total * percent + 99) / 100;
+
+    for(unsigned index = 0; index < LATENCY_BUCKETS; ++index) {
+        sum += buckets[index];
+        if(sum >= limit && sum)
+            return MappedLatency::floor(index);
+    }
+    return 0;
+}
+
+int bench::measure(unsigned count, unsigned seconds, unsigned threads)
+{
+    bench **senders, **receivers;
+    unsigned long buckets[LATENCY_BUCKETS];
+    unsigned long sent = 0, received = 0, gaps = 0, max = 0;
+    uint64_t started, elapsed, cpu, generating = 0;
+    unsigned id, ready = 0;
+    int result = 0;
+
+    if(!count)
+        return 2;
+
+    if(!seconds)
+        seconds = 10;
+
+    scount = count;
+    tcount = threads;
+    if(!tcount)
+        tcount = 1;
+    if(tcount > scount)
+        tcount = scount;
+
+    media::loopback(scount, threads);
+    streams = new stream_t[scount];
+    for(id = 0; id < scount; ++id) {
+        if(setup(&streams[id], id))
+            ++ready;
+    }
+
+    if(ready < scount) {
+        fprintf(stderr, "sipw: benchmark: only %u of %u streams proxied\n", ready, scount);
+        result = 1;
+        goto done;
+    }
+
+    // let the latching packets through before timing anything
+    Thread::sleep(100);
+    for(id = 0; id < scount; ++id)
+        streams[id].sent = streams[id].received = 0;
+
+    senders = new bench *[tcount];
+    receivers = new bench *[tcount];
+    sending = receiving = true;
+    cpu = usage(RUSAGE_SELF);
+    started = latency::now();
+    for(id = 0; id < tcount; ++id) {
+        receivers[id] = new bench(id, RECEIVE);
+        receivers[id]->start();
+        senders[id] = new bench(id, SEND);
+        senders[id]->start();
+    }
+
+    Thread::sleep(seconds * 1000l);
+    sending = false;
+    for(id = 0; id < tcount; ++id)
+        senders[id]->join();
+
+    // let packets still in the relay arrive
+    Thread::sleep(200);
+    receiving = false;
+    for(id = 0; id < tcount; ++id)
+        receivers[id]->join();
+
+    elapsed = latency::now() - started;
+    cpu = usage(RUSAGE_SELF) - cpu;
+
+    memset(buckets, 0, sizeof(buckets));
+    for(id = 0; id < tcount; ++id) {
+        generating += senders[id]->cpu + receivers[id]->cpu;
+        for(unsigned index = 0; index < LATENCY_BUCKETS; ++index)
+            buckets[index] += receivers[id]->buckets[index];
+        if(receivers[id]->max > max)
+            max = receivers[id]->max;
+        delete senders[id];
+        delete receivers[id];
+    }
+    delete[] senders;
+    delete[] receivers;
+
+    for(id = 0; id < scount; ++id) {
+        sent += streams[id].sent;
+        received += streams[id].received;
+        gaps += streams[id].gaps;
+    }
+
+    printf("streams:    %u over %u generator threads, %u sec\n", scount, tcount, seconds);
+    printf("packets:    %lu sent, %lu relayed, %lu lost (%.3f%%), %lu sequence gaps\n",
+        sent, received, sent - received,
+        sent ? (double)(sent - received) * 100.0 / (double)sent : 0.0, gaps);
+    printf("rate:       %.0f pps\n", (double)received * 1000000000.0 / (double)elapsed);
+    printf("latency:    p50 %lu, p90 %lu, p99 %lu, max %lu usec\n",
+        percentile(buckets, received, 50), percentile(buckets, received, 90),
+        percentile(buckets, received, 99), max);
+#ifdef  RUSAGE_THREAD
+    if(cpu > generating)
+        cpu -= generating;
+    printf("relay cpu:  %.3f%% of a core per stream\n",
+        (double)cpu * 100000.0 / (double)elapsed / (double)scount);
+#else
+    printf("total cpu:  %.3f%% of a core per stream (includes generator)\n",
+        (double)cpu * 100000.0 / (double)elapsed / (double)scount);
+#endif
+
+done:
+    for(id = 0; id < scount; ++id) {
+        if(streams[id].nat)
+            media::release(&streams[id].nat);
+        Socket::release(streams[id].source);
+        Socket::release(streams[id].sink);
+    }
+    media::shutdown();
+    delete[] streams;
+    streams = NULL;
+    return result;
+}
+
+bool bench::contend(unsigned entries, unsigned seconds, unsigned threads, unsigned stripes)
+{
+    bench **workers = new bench *[threads];
+    unsigned long buckets[LATENCY_BUCKETS];
+    unsigned long ops = 0, max = 0;
+    uint64_t started, elapsed;
+    unsigned id;
+
+    stripes = registry::loopback(entries, stripes);
+    memset(buckets, 0, sizeof(buckets));
+
+    sending = true;
+    started = latency::now();
+    for(id = 0; id < threads; ++id) {
+        workers[id] = new bench(id, SIGNAL);
+        workers[id]->start();
+    }
+
+    Thread::sleep(seconds * 1000l);
+    sending = false;
+    for(id = 0; id < threads; ++id)
+        workers[id]->join();
+    elapsed = latency::now() - started;
+
+    for(id = 0; id < threads; ++id) {
+        ops += workers[id]->ops;
+        for(unsigned index = 0; index < LATENCY_BUCKETS; ++index)
+            buckets[index] += workers[id]->buckets[index];
+        if(workers[id]->max > max)
+            max = workers[id]->max;
+        delete workers[id];
+    }
+    delete[] workers;
+
+    printf("threads %-3u stripes %-4u %.0f requests/sec, %.0f nsec each, p50 %lu, p99 %lu, max %lu usec\n",
+        threads, stripes, (double)ops * 1000000000.0 / (double)elapsed,
+        ops ? (double)elapsed * threads / (double)ops : 0.0,
+        percentile(buckets, ops, 50), percentile(buckets, ops, 99), max / 1000l);
+    return ops > 0;
+}
+
+int bench::contention(unsigned entries, unsigned seconds, unsigned threads)
+{
+    unsigned count = 1;
+    int result = 0;
+
+    if(!entries)
+        return 2;
+
+    if(!seconds)
+        seconds = 10;
+
+    if(!threads)
+        threads = 1;
+
+    // each entry registers from its own loopback port
+    scount = entries;
+    contacts = new Socket::address[entries];
+    for(unsigned id = 0; id < entries; ++id)
+        contacts[id].set("127.0.0.1", 1024 + id % 60000);
+
+    printf("registry:   %u entries, register and invite on 1 to %u threads, %u sec each\n", entries, threads, seconds);
+    for(;;) {
+        if(count > threads)
+            count = threads;
+        if(!contend(entries, seconds, count, 1) || !contend(entries, seconds, count, 0))
+            result = 1;
+        if(count == threads)
+            break;
+        count *= 2;
+    }
+
+    registry::shutdown();
+    delete[] contacts;
+    contacts = NULL;
+    return result;
+}
+
+#else
+
+bench::bench(unsigned id, kind_t type) : JoinableThread()
+{
+    index = id;
+    kind = type;
+}
+
+void bench::run(void)
+{
+}
+
+void bench::send(void)
+{
+}
+
+void bench::receive(void)
+{
+}
+
+void bench::signalling(void)
+{
+}
+
+bool bench::contend(unsigned entries, unsigned seconds, unsigned threads, unsigned stripes)
+{
+    return false;
+}
+
+int bench::measure(unsigned count, unsigned seconds, unsigned threads)
+{
+    fprintf(stderr, "sipw: benchmark: not supported on this platform\n");
+    return 2;
+}
+
+int bench::contention(unsigned entries, unsigned seconds, unsigned threads)
+{
+    fprintf(stderr, "sipw: contention: not supported on this platform\n");
+    return 2;
+}
+
+#endif
+
+} // end namespace
@@ -18,14 +18,30 @@
 
 namespace sipwitch {
 
+// Call and session strings are cut from a small arena of pages owned by the
+// call, each string taking only its own length, and all pages are freed at
+// once when the call is reaped.  Strings are never changed in place; a new
+// value is a new copy, and the old one stays until the call goes away.
+// The one exception is the sdp buffer of a session (see setSDP).
+
+#define STRING_PAGE     512
+
+static const char *nullstr = "";
+
 stack::call::call() : LinkedList(), segments()
 {
-    arm(stack::resetTimeout());
+    strings = NULL;
+    strfree = NULL;
+    stravail = 0;
+    forward = divert = dialed = subject = request = nullstr;
+    slot = 0;
+    deadline = 0;
     count = 0;
     forwarding = diverting = NULL;
     answering = 16; // should set from cfna timer...
     invited = ringing = ringbusy = unreachable = 0;
     phone = false;
+    released = false;
     expires = 0l;
     target = source = NULL;
     state = INITIAL;
@@ -33,18 +49,126 @@ stack::call::call() : LinkedList(), segments()
     starting = ending = 0l;
     reason = joined = NULL;
     map = NULL;
-    timer = Timer::inf;
+}
+
+stack::call::~call()
+{
+    void *next;
+
+    while(strings) {
+        next = *((void **)strings);
+        ::free(strings);
+        strings = next;
+    }
+}
+
+char *stack::call::dup(const char *text)
+{
+    if(!text)
+        text = nullstr;
+
+    size_t len = strlen(text) + 1;
+    size_t page = STRING_PAGE;
+    void **block;
+    char *str;
+
+    strlock.acquire();
+    if(len > stravail) {
+        if(len > page / 2)
+            page = len;
+        block = (void **)::malloc(sizeof(void *) + page);
+        if(!block) {
+            strlock.release();
+            return (char *)nullstr;
+        }
+        *block = strings;
+        strings = block;
+        // a large string gets a page of its own; keep the current page
+        if(page == len) {
+            str = (char *)(block + 1);
+            memcpy(str, text, len);
+            strlock.release();
+            return str;
+        }
+        strfree = (char *)(block + 1);
+        stravail = page;
+    }
+    str = strfree;
+    strfree += len;
+    stravail -= len;
+    memcpy(str, text, len);
+    strlock.release();
+    return str;
+}
+
+// every re-invite and session refresh brings a new sdp body, so rather
+// than adding each to the string arena, a session rewrites its own buffer
+// while the body fits.  Session sdp is only read by threads holding the
+// call stripe, and the caller already shares it, so the buffer is
+// rewritten with the stripe held exclusive and no reader sees it change.
+// An outgrown buffer is left on the string list and the new one is twice
+// its size, so a call only ever holds a few of them.
+
+const char *stack::call::setSDP(session *s, const char *text)
+{
+    assert(s != NULL);
+
+    stripelock *lock = stack::stripe(this);
+    size_t len, size;
+    void **block;
+
+    lock->exclusive();
+    if(!text || !*text) {
+        s->sdp = nullstr;
+        lock->share();
+        return s->sdp;
+    }
+
+    len = strlen(text) + 1;
+    if(len > s->sdpsize) {
+        size = s->sdpsize * 2;
+        if(size < len)
+            size = len;
+        block = (void **)::malloc(sizeof(void *) + size);
+        if(!block) {
+            s->sdp = nullstr;
+            lock->share();
+            return s->sdp;
+        }
+        strlock.acquire();
+        *block = strings;
+        strings = block;
+        strlock.release();
+        s->sdpbuf = (char *)(block + 1);
+        s->sdpsize = size;
+    }
+    memcpy(s->sdpbuf, text, len);
+    s->sdp = s->sdpbuf;
+    lock->share();
+    return s->sdp;
+}
+
+char *stack::call::format(const char *fmt, ...)
+{
+    char buf[MAX_SDP_BUFFER];
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    return dup(buf);
 }
 
 void stack::call::arm(timeout_t timeout)
 {
-    timer = timeout;
-    stack::background::notify();
+    // only a new earliest deadline needs to wake the background thread
+    if(stack::schedule(this, timeout))
+        stack::background::notify();
 }
 
 void stack::call::disarm(void)
 {
-    timer = Timer::inf;
+    stack::unschedule(this);
 }
 
 void stack::call::terminateLocked(void)
@@ -90,9 +214,11 @@ void stack::call::joinLocked(session *join)
     shell::debug(2, "joining call %08x:%u with session %08x:%u",
         source->sequence, source->cid, join->sequence, join->cid);
 
+    mapped_modify(map);
     String::set(map->target, sizeof(map->target), join->sysident);
     if(!map->active)
         time(&map->active);
+    mapped_commit(map);
 
     // once we have joined, there is no more forwarding...
     forwarding = diverting = NULL;
@@ -224,8 +350,10 @@ void stack::call::set(state_t flag, char id, const char *text)
     if(!map)
         return;
 
+    mapped_modify(map);
     map->state[0] = id;
     String::set(map->state + 1, sizeof(map->state) - 1, text);
+    mapped_commit(map);
 }
 
 void stack::call::bye(thread *thread, session *s)
@@ -349,7 +477,7 @@ void stack::call::reinvite(thread *thread, session *s)
     voip::context_t ctx = source->context;
     session *update = source;
     bool holding = false;
-    char *sdp;
+    const char *sdp;
     int error = 200;
 
     assert(thread != NULL);
@@ -738,9 +866,9 @@ timeout_t stack::call::getTimeout(void)
 {
     timeout_t current;
     Mutex::protect(this);
-    current = timer.get();
-    if(current < 2) {
-        timer = Timer::inf;
+    current = stack::remaining(this);
+    if(current < 2 && !released) {
+        stack::unschedule(this);
         expired();
     }
     Mutex::release(this);
@@ -829,6 +957,17 @@ cdr *stack::call::log(void)
         snprintf(node->network, sizeof(node->network), "%s/%s", source->network, target->network);
     else
         String::set(node->network, sizeof(node->network), source->network);
+
+    // proxies of a session carry the media of the other party's sdp
+    linked_pointer<segment> sp = segments.begin();
+    while(is(sp)) {
+        if(&(sp->sid) == source)
+            media::collect(&sp->sid, &node->callee, &node->caller);
+        else
+            media::collect(&sp->sid, &node->caller, &node->callee);
+        sp.next();
+    }
+
     starting = 0l;
     return node;
 }
@@ -0,0 +1,378 @@
+// Copyright (C) 2006-2014 David Sugar, Tycho Softworks.
+// Copyright (C) 2015 Cherokees of Idaho.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "server.h"
+
+namespace sipwitch {
+
+// Dial patterns are compiled into a digit trie.  Each trie edge is either a
+// literal dialed digit, '*' or '#', or one of the service::match wildcards,
+// so a lookup only follows the edges that can accept the next digit.  The
+// result is the same as testing every pattern with service::match in rank
+// order: highest priority first, then highest order.  Patterns the trie
+// cannot express (such as +suffix matching) are kept on a short fallback
+// list, and every pattern is also indexed by text, since service::match
+// falls back to a plain case insensitive compare for non-numeric ids.
+
+#define DIAL_ANY        12
+#define DIAL_NXX        13
+#define DIAL_NONZERO    14
+#define DIAL_OPTIONAL   15
+#define DIAL_SINGLE     16
+
+// reduce an id to dialed digits the way service::match does; returns -1
+// if the id is not numeric, and 0 if it can never match a digit pattern.
+
+static int normalize(const char *id, char *buf, size_t size)
+{
+    const char *d = id;
+    size_t len = 0;
+
+    if(*d == '+')
+        ++d;
+
+    while(*d && len < size - 1) {
+        if(isdigit(*d) || *d == '*' || *d == '#') {
+            buf[len++] = *(d++);
+            continue;
+        }
+
+        if(*d == ' ' || *d == ',') {
+            ++d;
+            continue;
+        }
+
+        if(*d == '!')
+            break;
+
+        return -1;
+    }
+
+    buf[len] = 0;
+    if(*d && *d != '!')
+        return 0;
+
+    return 1;
+}
+
+dialplan::dialplan(unsigned size, memalloc *mem)
+{
+    pager = mem;
+    keysize = size;
+    if(!keysize)
+        keysize = 1;
+    count = 0;
+    fallback = NULL;
+    root = (node *)alloc(sizeof(node));
+    memset(root, 0, sizeof(node));
+    texts = (LinkedObject **)alloc(sizeof(LinkedObject *) * keysize);
+    memset(texts, 0, sizeof(LinkedObject *) * keysize);
+}
+
+dialplan::~dialplan()
+{
+    linked_pointer<rule> rp;
+
+    // paged plans are released with their pager...
+    if(pager)
+        return;
+
+    for(unsigned path = 0; path < keysize; ++path) {
+        rp = texts[path];
+        while(is(rp)) {
+            rule *next = static_cast<rule *>(rp->getNext());
+            free(*rp);
+            rp = next;
+        }
+    }
+
+    rp = fallback;
+    while(is(rp)) {
+        rule *next = static_cast<rule *>(rp->getNext());
+        free(*rp);
+        rp = next;
+    }
+
+    purge(root);
+    free(texts);
+}
+
+void *dialplan::alloc(size_t size)
+{
+    if(pager)
+        return pager->alloc(size);
+
+    return ::operator new(size);
+}
+
+void dialplan::free(void *mem)
+{
+    if(!pager && mem)
+        ::operator delete(mem);
+}
+
+void dialplan::purge(node *np)
+{
+    linked_pointer<rule> rp = np->rules;
+
+    while(is(rp)) {
+        rule *next = static_cast<rule *>(rp->getNext());
+        free(*rp);
+        rp = next;
+    }
+
+    for(unsigned code = 0; code < 17; ++code) {
+        if(np->child[code])
+            purge(np->child[code]);
+    }
+    free(np);
+}
+
+int dialplan::select(char code)
+{
+    switch(code) {
+    case '*':
+        return 10;
+    case '#':
+        return 11;
+    case 'x':
+    case 'X':
+        return DIAL_ANY;
+    case 'n':
+    case 'N':
+        return DIAL_NXX;
+    case 'z':
+    case 'Z':
+        return DIAL_NONZERO;
+    case 'o':
+    case 'O':
+        return DIAL_OPTIONAL;
+    case '?':
+        return DIAL_SINGLE;
+    default:
+        if(code >= '0' && code <= '9')
+            return code - '0';
+        return -1;
+    }
+}
+
+void dialplan::rank(rule *rp, unsigned limit, rule **best)
+{
+    if(rp->priority >= limit)
+        return;
+
+    if(!*best || rp->priority > (*best)->priority)
+        *best = rp;
+    else if(rp->priority == (*best)->priority && rp->order > (*best)->order)
+        *best = rp;
+}
+
+dialplan::rule *dialplan::create(const char *text, void *object, unsigned priority, unsigned long order, bool exact)
+{
+    rule *rp = (rule *)alloc(sizeof(rule));
+
+    new(rp) rule;
+    rp->text = text;
+    rp->object = object;
+    rp->priority = priority;
+    rp->order = order;
+    rp->exact = exact;
+    return rp;
+}
+
+void dialplan::add(const char *pattern, void *object, unsigned priority, unsigned long order)
+{
+    assert(pattern != NULL);
+
+    const char *cp = pattern;
+    node *np = root;
+    rule *rp;
+    int code;
+
+    if(*pattern) {
+        rp = create(pattern, object, priority, order, false);
+        rp->enlist(&texts[NamedObject::keyindex(pattern, keysize)]);
+    }
+    rp = create(pattern, object, priority, order, false);
+    ++count;
+
+    while(*cp && select(*cp) > -1)
+        ++cp;
+
+    // an empty pattern matches any dialed number, as service::match does
+    if(*cp || !*pattern) {
+        rp->enlist(&fallback);
+        return;
+    }
+
+    cp = pattern;
+    while(*cp) {
+        code = select(*(cp++));
+        if(!np->child[code]) {
+            np->child[code] = (node *)alloc(sizeof(node));
+            memset(np->child[code], 0, sizeof(node));
+        }
+        np = np->child[code];
+    }
+    rp->enlist(&np->rules);
+}
+
+void dialplan::identity(const char *id, void *object, unsigned priority, unsigned long order)
+{
+    assert(id != NULL && *id != 0);
+
+    rule *rp = create(id, object, priority, order, true);
+    rp->enlist(&texts[NamedObject::keyindex(id, keysize)]);
+    ++count;
+}
+
+void dialplan::unlist(LinkedObject **list, const char *text, void *object)
+{
+    linked_pointer<rule> rp = *list;
+
+    while(is(rp)) {
+        if(rp->object == object && String::equal(rp->text, text)) {
+            rp->delist(list);
+            free(*rp);
+            return;
+        }
+        rp.next();
+    }
+}
+
+bool dialplan::remove(node *np, const char *cp, const char *text, void *object)
+{
+    node *child;
+
+    if(!*cp)
+        unlist(&np->rules, text, object);
+    else {
+        child = np->child[select(*cp)];
+        if(child && remove(child, cp + 1, text, object)) {
+            free(child);
+            np->child[select(*cp)] = NULL;
+        }
+    }
+
+    if(np->rules)
+        return false;
+
+    for(unsigned code = 0; code < 17; ++code) {
+        if(np->child[code])
+            return false;
+    }
+    return true;
+}
+
+void dialplan::remove(const char *pattern, void *object)
+{
+    assert(pattern != NULL);
+
+    const char *cp = pattern;
+
+    if(*pattern)
+        unlist(&texts[NamedObject::keyindex(pattern, keysize)], pattern, object);
+
+    while(*cp && select(*cp) > -1)
+        ++cp;
+
+    if(*cp || !*pattern)
+        unlist(&fallback, pattern, object);
+    else
+        remove(root, pattern, pattern, object);
+
+    if(count)
+        --count;
+}
+
+void dialplan::search(node *np, const char *digits, unsigned limit, rule **best) const
+{
+    linked_pointer<rule> rp;
+    node *child;
+    char code = *digits;
+
+    // service::match accepts a pattern once it is used up, even if some
+    // dialed digits are left over, so every node reached is a match...
+    rp = np->rules;
+    while(is(rp)) {
+        rank(*rp, limit, best);
+        rp.next();
+    }
+
+    if(!code)
+        return;
+
+    child = np->child[select(code)];
+    if(child)
+        search(child, digits + 1, limit, best);
+
+    child = np->child[DIAL_ANY];
+    if(child && isdigit(code))
+        search(child, digits + 1, limit, best);
+
+    child = np->child[DIAL_NXX];
+    if(child && code >= '2' && code <= '9')
+        search(child, digits + 1, limit, best);
+
+    child = np->child[DIAL_NONZERO];
+    if(child && code >= '1' && code <= '9')
+        search(child, digits + 1, limit, best);
+
+    child = np->child[DIAL_SINGLE];
+    if(child)
+        search(child, digits + 1, limit, best);
+
+    // optional 1 only consumes a dialed 1...
+    child = np->child[DIAL_OPTIONAL];
+    if(child && code == '1')
+        search(child, digits + 1, limit, best);
+    else if(child)
+        search(child, digits, limit, best);
+}
+
+void *dialplan::find(const char *id, unsigned limit) const
+{
+    assert(id != NULL && *id != 0);
+
+    char digits[32];
+    rule *best = NULL;
+    linked_pointer<rule> rp;
+    int kind = normalize(id, digits, sizeof(digits));
+
+    if(kind > 0) {
+        search(root, digits, limit, &best);
+        rp = fallback;
+        while(is(rp)) {
+            if(service::match(id, rp->text, false))
+                rank(*rp, limit, &best);
+            rp.next();
+        }
+    }
+
+    rp = texts[NamedObject::keyindex(id, keysize)];
+    while(is(rp)) {
+        if((rp->exact || kind < 0) && !stricmp(id, rp->text))
+            rank(*rp, limit, &best);
+        rp.next();
+    }
+
+    if(!best)
+        return NULL;
+
+    return best->object;
+}
+
+} // end namespace
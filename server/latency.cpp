@@ -0,0 +1,251 @@
+// Copyright (C) 2006-2014 David Sugar, Tycho Softworks.
+// Copyright (C) 2015 Cherokees of Idaho.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "server.h"
+
+namespace sipwitch {
+
+// Histograms are kept directly in shared memory, one record for each kind
+// of sip event (as named by thread::eid), one for the time events wait in
+// a worker queue, and one each for time spent waiting on registry and
+// stack stripe locks.  Recording an event is a clock read and a few
+// atomic updates, so it is always on.  Stripe locks are taken far more
+// often than events are posted, so only one in LATENCY_SAMPLE lock
+// acquisitions is timed, and those samples are kept per thread and merged
+// into the shared record every LATENCY_FLUSH samples or once a second.
+// Threads that go idle merge what they hold from their idle loop, and
+// threads that exit merge it as they go.
+
+#if defined(__GNUC__)
+#define LATENCY_ADD(x, v)   __sync_add_and_fetch(&(x), v)
+#define LATENCY_CAS(x, o, n) __sync_bool_compare_and_swap(&(x), o, n)
+#else
+#define LATENCY_ADD(x, v)   ((x) += (v))
+#define LATENCY_CAS(x, o, n) ((x) = (n), true)
+#endif
+
+#if defined(_MSC_VER)
+#define LATENCY_LOCAL   __declspec(thread)
+#else
+#define LATENCY_LOCAL   __thread
+#endif
+
+#define LATENCY_SAMPLE  16
+#define LATENCY_FLUSH   64
+#define LATENCY_LOCKS   2       // registry and stack stripe lock slots
+
+typedef struct {
+    unsigned long count, max;
+    uint64_t total, flushed;
+    uint32_t buckets[LATENCY_BUCKETS];
+} pending_t;
+
+static LATENCY_LOCAL unsigned skipped = 0;
+static LATENCY_LOCAL pending_t pending[LATENCY_LOCKS];
+
+#ifndef _MSWINDOWS_
+static pthread_key_t exiting;
+static pthread_once_t keyed = PTHREAD_ONCE_INIT;
+static LATENCY_LOCAL bool attached = false;
+
+static void exited(void *arg)
+{
+    latency::flush();
+}
+
+static void keying(void)
+{
+    pthread_key_create(&exiting, &exited);
+}
+#endif
+
+static class __LOCAL histograms : public mapped_array<MappedLatency>
+{
+public:
+    histograms();
+
+    void init(unsigned count);
+} shm;
+
+static MappedLatency *records = NULL;
+static unsigned used = 0;
+static unsigned slots[EXOSIP_EVENT_COUNT];
+
+static void maximum(MappedLatency *node, unsigned long usec)
+{
+    unsigned long max;
+
+    for(;;) {
+        max = node->max;
+        if(usec <= max || LATENCY_CAS(node->max, max, usec))
+            return;
+    }
+}
+
+static void merge(unsigned slot, pending_t *local)
+{
+    MappedLatency *node = &records[slot];
+
+    for(unsigned index = 0; index < LATENCY_BUCKETS; ++index) {
+        if(local->buckets[index])
+            LATENCY_ADD(node->buckets[index], local->buckets[index]);
+    }
+    LATENCY_ADD(node->count, local->count);
+    LATENCY_ADD(node->total, local->total);
+    maximum(node, local->max);
+    memset(local, 0, sizeof(pending_t));
+}
+
+histograms::histograms() : mapped_array<MappedLatency>()
+{
+}
+
+void histograms::init(unsigned count)
+{
+    const char *latencymap = control::env("latencymap");
+    ::remove(latencymap);
+    create(latencymap, count);
+}
+
+static unsigned request(const char *id)
+{
+    unsigned index;
+
+    for(index = 0; index < used; ++index) {
+        if(eq(records[index].id, id))
+            return index;
+    }
+
+    MappedLatency *node = shm(used);
+    memset(node, 0, sizeof(MappedLatency));
+    String::set(node->id, sizeof(node->id), id);
+    return used++;
+}
+
+void latency::start(void)
+{
+    unsigned type;
+
+    shm.init(EXOSIP_EVENT_COUNT + 3);
+    records = shm(0);
+    if(!records) {
+        shell::log(shell::ERR, "latency could not be mapped");
+        return;
+    }
+
+    request("queue");
+    request("registry.lock");
+    request("stack.lock");
+    for(type = 0; type < EXOSIP_EVENT_COUNT; ++type)
+        slots[type] = request(thread::eid((eXosip_event_type)type));
+}
+
+void latency::stop(void)
+{
+    records = NULL;
+    shm.release();
+    MappedMemory::remove(control::env("latencymap"));
+}
+
+uint64_t latency::now(void)
+{
+#ifdef  _MSWINDOWS_
+    return (uint64_t)GetTickCount64() * 1000000l;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000l + (uint64_t)now.tv_nsec;
+#endif
+}
+
+unsigned latency::event(int type)
+{
+    if(type < 0 || type >= EXOSIP_EVENT_COUNT)
+        return QUEUE;
+    return slots[type];
+}
+
+void latency::record(unsigned slot, uint64_t started)
+{
+    MappedLatency *node;
+    unsigned long usec;
+
+    if(!records || slot >= used)
+        return;
+
+    node = &records[slot];
+    usec = (unsigned long)((now() - started) / 1000l);
+    LATENCY_ADD(node->buckets[MappedLatency::bucket(usec)], 1);
+    LATENCY_ADD(node->count, 1);
+    LATENCY_ADD(node->total, usec);
+    maximum(node, usec);
+}
+
+uint64_t latency::sample(void)
+{
+    if(++skipped < LATENCY_SAMPLE)
+        return 0;
+
+    skipped = 0;
+    return now();
+}
+
+void latency::waited(unsigned slot, uint64_t started)
+{
+    pending_t *local;
+    uint64_t current = now();
+    unsigned long usec = (unsigned long)((current - started) / 1000l);
+
+    if(!records || slot < REGISTRY_LOCK || slot >= REGISTRY_LOCK + LATENCY_LOCKS)
+        return;
+
+#ifndef _MSWINDOWS_
+    if(!attached) {
+        pthread_once(&keyed, &keying);
+        pthread_setspecific(exiting, &attached);
+        attached = true;
+    }
+#endif
+
+    local = &pending[slot - REGISTRY_LOCK];
+    ++local->buckets[MappedLatency::bucket(usec)];
+    ++local->count;
+    local->total += usec;
+    if(usec > local->max)
+        local->max = usec;
+
+    if(!local->flushed)
+        local->flushed = current;
+
+    if(local->count < LATENCY_FLUSH && current - local->flushed < 1000000000l)
+        return;
+
+    merge(slot, local);
+    local->flushed = current;
+}
+
+void latency::flush(void)
+{
+    if(!records)
+        return;
+
+    for(unsigned index = 0; index < LATENCY_LOCKS; ++index) {
+        if(pending[index].count)
+            merge(REGISTRY_LOCK + index, &pending[index]);
+    }
+}
+
+} // end namespace
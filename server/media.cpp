@@ -16,44 +16,375 @@
 
 #include "server.h"
 
+#ifdef  HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <netinet/udp.h>
+#include <pthread.h>
+#endif
+
 namespace sipwitch {
 
+// Where epoll is available each active proxy socket is registered edge
+// triggered with the proxy itself as user data, so a wakeup goes straight
+// to the proxies that have packets, and there is no limit on descriptor
+// numbers.  Since the proxy sockets are non-blocking, each ready socket
+// is drained before waiting again.  Otherwise a select() set is used,
+// which limits the proxy to FD_SETSIZE descriptors.
+
+#define MEDIA_EVENTS    64
+
+// With epoll, a ready proxy is read with recvmmsg() a batch at a time and
+// the batch is relayed with sendmmsg().  When a whole batch goes to one
+// address in equal sized packets (the usual rtp stream) it is instead sent
+// as one UDP_SEGMENT (gso) write, until the kernel refuses that once.
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(MSG_WAITFORONE)
+#define MEDIA_BATCH     16
+#endif
+
+// Receive buffers hold a full ethernet frame's payload, so video is not
+// cut short; a larger packet is dropped and counted as a relay error
+// rather than relayed truncated.
+
+#define MEDIA_PACKET    1536
+
+// With epoll the relay runs as a set of media threads, each with its own
+// epoll instance and shard lock.  A proxy is given to a thread round robin
+// when it is activated, so its packets are only ever copied by that thread,
+// and the global lock is then only needed to claim and return proxies.  The
+// threads may be pinned to cpus listed in the media affinity key.
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(CPU_SET)
+#define MEDIA_AFFINITY
+#endif
+
 static unsigned tpriority = 0;
+static unsigned inactivity = 0;
 static unsigned baseport = 5062;
 static bool ipv6 = false;
-static LinkedObject *runlist = NULL;
+static LinkedObject *unbound = NULL;
+static LinkedObject *expiring = NULL;
 static mutex_t lock;
 static media::proxy *list = NULL;
+static volatile bool running = false;
+#ifdef  HAVE_SYS_EPOLL_H
+static unsigned threads = 1;
+static unsigned assigned = 0;
+static media::thread **workers = NULL;
+static char affinity[64] = "";
+#endif
+#if defined(MEDIA_BATCH) && defined(UDP_SEGMENT)
+static volatile bool segmenting = true;
+#endif
+#ifndef HAVE_SYS_EPOLL_H
 static fd_set connections;
 static media::proxy *proxymap[sizeof(connections) * 8];
-static volatile bool running = false;
 static volatile int hiwater = 0;
+#endif
 
 #ifdef  _MSWINDOWS_
 static unsigned portcount = 0;
 #else
+#ifndef HAVE_SYS_EPOLL_H
 static int control[2];
+#endif
 static unsigned portcount = 38;
 #endif
 
 static media _proxy;
+static volatile unsigned stopped = 0;
+#ifndef HAVE_SYS_EPOLL_H
 static media::thread *th = NULL;
+#endif
 
 static unsigned align(unsigned value)
 {
     return ((value + 1) / 2) * 2;
 }
 
-media::thread::thread() : DetachedThread()
+// Whether media between two subnets needs a proxy, and the peering address
+// to use if so, only changes when subnets are reloaded or brought up or
+// down.  Decisions are kept in a small direct mapped cache keyed by the
+// pair of network names, and a new generation invalidates all of them.
+
+#define MEDIA_PATHS     64
+
+static struct {
+    char source[MAX_NETWORK_SIZE], target[MAX_NETWORK_SIZE];
+    unsigned generation;
+    bool ipv6, proxy;
+    struct sockaddr_storage peering;
+} paths[MEDIA_PATHS];
+
+static rwlock_t pathlock;
+static volatile unsigned generation = 1;
+
+static unsigned pathkey(const char *source, const char *target)
+{
+    unsigned key = 0;
+
+    while(*source)
+        key = (key * 31) + (unsigned char)*(source++);
+    key = (key * 31) + '/';
+    while(*target)
+        key = (key * 31) + (unsigned char)*(target++);
+    return key % MEDIA_PATHS;
+}
+
+static void setport(struct sockaddr *address, unsigned short port)
+{
+    switch(address->sa_family) {
+#ifdef  AF_INET6
+    case AF_INET6:
+        ((struct sockaddr_in6*)(address))->sin6_port = htons(port);
+        break;
+#endif
+    case AF_INET:
+        ((struct sockaddr_in*)(address))->sin_port = htons(port);
+    }
+}
+
+// Proxies are kept on free stacks so a call can take one without a search.
+// A proxy returned from a call keeps its socket bound and registered, and
+// goes on the stack for the interface it was bound to, ready to be handed
+// straight to the next call on that interface.  Proxies never yet opened
+// wait on the unbound stack.  Those released with an expire time are held
+// on the expiring list until media::cleanup() returns them.
+//
+// Proxies are allocated in pairs, an even rtp port and the rtcp port above
+// it, and only the rtp proxy of a pair is ever on a free stack.  Its rtcp
+// partner is the next entry in the list, follows it from stack to stack,
+// and is only closed when it is.
+
+#define MEDIA_INTERFACES    8
+
+static struct {
+    struct sockaddr_storage address;
+    LinkedObject *free;
+} interfaces[MEDIA_INTERFACES];
+
+static unsigned ifcount = 0;
+
+static unsigned ifpool(struct sockaddr *address)
+{
+    unsigned index = 0;
+
+    while(index < ifcount) {
+        if(Socket::equalhost((struct sockaddr *)&interfaces[index].address, address))
+            return index;
+        ++index;
+    }
+
+    if(ifcount >= MEDIA_INTERFACES)
+        return ifcount;
+
+    Socket::store(&interfaces[ifcount].address, address);
+    interfaces[ifcount].free = NULL;
+    return ifcount++;
+}
+
+static media::proxy *pop(LinkedObject **stack)
+{
+    media::proxy *pp = (media::proxy *)*stack;
+
+    if(pp)
+        *stack = pp->getNext();
+    return pp;
+}
+
+static void recycle(media::proxy *pp)
+{
+    unsigned index = ifpool((struct sockaddr *)&pp->peering);
+
+    pp->reset();
+
+    // an rtcp proxy goes back with the rtp proxy it is paired with
+    if(pp->port & 1)
+        return;
+
+    if(pp->so != INVALID_SOCKET && index < ifcount)
+        pp->enlist(&interfaces[index].free);
+    else {
+        pp->close();
+        (pp + 1)->close();
+        pp->enlist(&unbound);
+    }
+}
+
+#ifdef  HAVE_SYS_EPOLL_H
+
+// cpu for a media thread, taken round robin from the affinity list
+static int processor(unsigned index)
 {
+    unsigned count = 0;
+    const char *cp = affinity;
+    char *ep;
+    long cpu;
+
+    while(*cp) {
+        cpu = strtol(cp, &ep, 10);
+        if(ep == cp)
+            break;
+        if(count++ == index)
+            return (int)cpu;
+        cp = ep;
+        while(*cp == ',' || isspace(*cp))
+            ++cp;
+    }
+    if(!count)
+        return -1;
+    return processor(index % count);
+}
+
+media::thread::thread(unsigned id) : DetachedThread()
+{
+    struct epoll_event ev;
+
+    index = id;
+    cpu = processor(id);
+    wakeup[0] = wakeup[1] = -1;
+    epfd = epoll_create(portcount / threads + 1);
+    if(epfd < 0 || pipe(wakeup)) {
+        shell::log(shell::ERR, "media thread %u startup failed", id);
+        if(epfd > -1)
+            ::close(epfd);
+        epfd = wakeup[0] = wakeup[1] = -1;
+        return;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, wakeup[0], &ev);
+}
+
+media::thread::~thread()
+{
+    if(wakeup[0] > -1) {
+        ::close(wakeup[0]);
+        ::close(wakeup[1]);
+    }
+    if(epfd > -1)
+        ::close(epfd);
 }
 
 void media::thread::startup(void)
 {
-    th = new thread();
+    running = true;
+    stopped = 0;
+    workers = new media::thread *[threads];
+    for(unsigned id = 0; id < threads; ++id)
+        workers[id] = new thread(id);
+    for(unsigned id = 0; id < threads; ++id)
+        workers[id]->start(tpriority);
+}
+
+media::thread *media::thread::assign(void)
+{
+    return workers[assigned++ % threads];
+}
+
+void media::thread::notify(void)
+{
+    char buf[1];
+
+    for(unsigned id = 0; id < threads; ++id) {
+        if(workers[id]->wakeup[1] < 0)
+            continue;
+        if(::write(workers[id]->wakeup[1], &buf, 1) < 1)
+            shell::log(shell::ERR, "media notify failure");
+    }
+}
+
+void media::thread::shutdown(void)
+{
+    running = false;
+
+    notify();
+
+    while(stopped < threads) {
+        Thread::sleep(100);
+    }
+
+    // detached threads delete themselves as they exit
+    delete[] workers;
+    workers = NULL;
+}
+
+void media::thread::run(void)
+{
+    struct epoll_event events[MEDIA_EVENTS];
+    int count, event;
+    media::proxy *mp;
+    char buf[1];
+
+#ifdef  MEDIA_AFFINITY
+    if(cpu > -1) {
+        cpu_set_t mask;
+        CPU_ZERO(&mask);
+        CPU_SET(cpu, &mask);
+        if(pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask))
+            shell::log(shell::WARN, "media thread %u cannot use cpu %d", index, cpu);
+    }
+#endif
+
+    shell::log(DEBUG1, "starting media thread %u", index);
+
+    while(running && epfd > -1) {
+        count = epoll_wait(epfd, events, MEDIA_EVENTS, -1);
+        if(!running)
+            break;
+
+        for(event = 0; event < count; ++event) {
+            mp = (media::proxy *)events[event].data.ptr;
+            if(!mp) {
+                if(::read(wakeup[0], buf, 1) < 1)
+                    shell::log(shell::ERR, "media control failure");
+                continue;
+            }
+
+            // a proxy closed and reopened on another shard may still have
+            // an event pending here; that thread owns it now.
+            shard.acquire();
+            if(mp->owner == this && mp->so != INVALID_SOCKET) {
+                while(mp->copy()) {
+                }
+            }
+            shard.release();
+        }
+    }
+
+    shell::log(DEBUG1, "stopping media thread %u", index);
+    lock.acquire();
+    ++stopped;
+    lock.release();
+}
+#else
+media::thread::thread(unsigned id) : DetachedThread()
+{
+    index = id;
+    cpu = -1;
+    epfd = wakeup[0] = wakeup[1] = -1;
+}
+
+media::thread::~thread()
+{
+}
+
+void media::thread::startup(void)
+{
+    running = true;
+    stopped = 0;
+    th = new thread(0);
     th->start(tpriority);
 }
 
+media::thread *media::thread::assign(void)
+{
+    return th;
+}
+
 void media::thread::notify(void)
 {
 #ifdef  _MSWINDOWS_
@@ -70,7 +401,7 @@ void media::thread::shutdown(void)
 
     notify();
 
-    while(!running) {
+    while(!stopped) {
         Thread::sleep(100);
     }
 }
@@ -81,10 +412,8 @@ void media::thread::run(void)
     socket_t max;
 
     shell::log(DEBUG1, "starting media thread");
-    running = true;
     socket_t so;
     media::proxy *mp;
-    time_t now;
 
     while(running) {
         lock.acquire();
@@ -95,7 +424,6 @@ void media::thread::run(void)
         if(!running)
             break;
 
-        time(&now);
         for(so = 0; so < max; ++so) {
 #ifdef  _MSWINDOWS_
 #else
@@ -117,9 +445,7 @@ void media::thread::run(void)
                 mp = NULL;
             }
 
-            if(mp && mp->expires && mp->expires < now)
-                mp->release(0);
-            else if(mp)
+            if(mp)
                 mp->copy();
 
             lock.release();
@@ -127,16 +453,19 @@ void media::thread::run(void)
     }
 
     shell::log(DEBUG1, "stopping media thread");
-    running = true;
+    stopped = 1;
 }
+#endif
 
 media::proxy::proxy() :
-LinkedObject(&runlist)
+LinkedObject()
 {
     so = INVALID_SOCKET;
     expires = 0l;
     port = baseport++;
     fw = false;
+    owner = NULL;
+    activated = 0l;
 }
 
 media::proxy::~proxy()
@@ -149,40 +478,280 @@ void media::proxy::release()
     LinkedObject::release();
 }
 
-void media::proxy::copy(void)
+// rtp clock rate of the static payload types, 0 where unknown (dynamic
+// types are negotiated in the sdp, so no jitter is estimated for them)
+static unsigned clockrate(unsigned type)
 {
-    char buffer[1024];
-    struct sockaddr_storage where;
-    struct sockaddr *wp = (struct sockaddr *)&where;
-    ssize_t count = Socket::recvfrom(so, buffer, sizeof(buffer), 0, &where);
+    switch(type) {
+    case 10:
+    case 11:
+        return 44100;
+    case 6:
+        return 16000;
+    case 16:
+        return 11025;
+    case 17:
+        return 22050;
+    case 14:
+    case 25:
+    case 26:
+    case 28:
+    case 31:
+    case 32:
+    case 33:
+    case 34:
+        return 90000;
+    default:
+        if(type < 19)
+            return 8000;
+        return 0;
+    }
+}
 
-    if(count < 1)
+// Only the fixed rtp header is looked at.  rtcp (payload types 72-76 with
+// the marker bit, as in rfc 5761) and anything not rtp version 2 is just
+// counted.  Loss is from gaps in the sequence numbers; late and duplicate
+// packets are not subtracted.  Arrival time is that of the batch.
+void media::proxy::stream::update(const uint8_t *header, size_t len, uint64_t usec, time_t now)
+{
+    uint16_t seq, gap;
+    unsigned rate;
+    uint32_t stamp;
+    int64_t delta;
+    unsigned long diff;
+
+    ++packets;
+    bytes += len;
+    last = now;
+
+    if(len < 12 || (header[0] & 0xc0) != 0x80)
         return;
 
-    if(Socket::equal(wp, (struct sockaddr *)&local)) {
-        Socket::sendto(so, buffer, count, 0, (struct sockaddr *)&remote);
+    if(header[1] >= 192 && header[1] <= 223)
+        return;
+
+    seq = ((uint16_t)header[2] << 8) | header[3];
+    stamp = ((uint32_t)header[4] << 24) | ((uint32_t)header[5] << 16) |
+        ((uint32_t)header[6] << 8) | header[7];
+    rate = clockrate(header[1] & 0x7f);
+
+    if(!started) {
+        started = true;
+        sequence = seq;
+        if(rate)
+            transit = (int64_t)usec - (int64_t)stamp * 1000000l / rate;
         return;
     }
-    Socket::store(&remote, wp);
-    Socket::sendto(so, buffer, count, 0, (struct sockaddr *)&local);
+
+    gap = (uint16_t)(seq - sequence);
+    if(gap == 0 || gap > 0x8000)
+        return;
+
+    lost += gap - 1;
+    sequence = seq;
+
+    if(!rate)
+        return;
+
+    delta = (int64_t)usec - (int64_t)stamp * 1000000l / rate;
+    if(delta < transit)
+        diff = (unsigned long)(transit - delta);
+    else
+        diff = (unsigned long)(delta - transit);
+    jitter += diff - ((jitter + 8) >> 4);
+    transit = delta;
 }
 
-void media::proxy::reconnect(struct sockaddr *host)
+#ifdef  MEDIA_BATCH
+#ifdef  UDP_SEGMENT
+static bool segment(socket_t so, struct mmsghdr *out, unsigned count)
 {
-    struct sockaddr *hp = (struct sockaddr *)&local;
+    struct iovec iov[MEDIA_BATCH];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    char cbuf[CMSG_SPACE(sizeof(uint16_t))];
+    size_t size = out[0].msg_hdr.msg_iov->iov_len;
+    uint16_t seglen = (uint16_t)size;
+    unsigned index;
+
+    if(!segmenting || count < 2)
+        return false;
 
-    switch(host->sa_family) {
-#ifdef  AF_INET6
-    case AF_INET6:
-        ((struct sockaddr_in6*)(host))->sin6_port =
-            ((struct sockaddr_in6 *)(hp))->sin6_port;
+    // the last packet may be short, all others must match
+    for(index = 0; index < count; ++index) {
+        if(index && memcmp(out[index].msg_hdr.msg_name, out[0].msg_hdr.msg_name, out[0].msg_hdr.msg_namelen))
+            return false;
+        if(index < count - 1 && out[index].msg_hdr.msg_iov->iov_len != size)
+            return false;
+        if(out[index].msg_hdr.msg_iov->iov_len > size)
+            return false;
+        iov[index] = *out[index].msg_hdr.msg_iov;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = out[0].msg_hdr.msg_name;
+    msg.msg_namelen = out[0].msg_hdr.msg_namelen;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    memcpy(CMSG_DATA(cm), &seglen, sizeof(seglen));
+
+    if(::sendmsg(so, &msg, 0) > 0)
+        return true;
+
+    // only errors that mean the kernel or device cannot segment disable it;
+    // others, such as an unreachable peer, are for this send alone.
+    switch(errno) {
+    case EIO:
+    case EINVAL:
+    case ENOPROTOOPT:
+    case EOPNOTSUPP:
+        shell::log(DEBUG1, "media segmentation unavailable");
+        segmenting = false;
+        break;
+    default:
         break;
+    }
+    return false;
+}
 #endif
-    case AF_INET:
-        ((struct sockaddr_in*)(host))->sin_port =
-            ((struct sockaddr_in *)(hp))->sin_port;
+
+bool media::proxy::copy(void)
+{
+    char buffers[MEDIA_BATCH][MEDIA_PACKET];
+    struct sockaddr_storage from[MEDIA_BATCH], to[MEDIA_BATCH];
+    struct iovec iov[MEDIA_BATCH];
+    struct mmsghdr in[MEDIA_BATCH], out[MEDIA_BATCH];
+    stream *path[MEDIA_BATCH];
+    struct sockaddr *wp;
+    int count, index, relayed = 0, sending = 0, result;
+    uint64_t usec;
+    time_t now;
+
+    memset(in, 0, sizeof(in));
+    for(index = 0; index < MEDIA_BATCH; ++index) {
+        iov[index].iov_base = buffers[index];
+        iov[index].iov_len = sizeof(buffers[index]);
+        in[index].msg_hdr.msg_name = &from[index];
+        in[index].msg_hdr.msg_namelen = sizeof(from[index]);
+        in[index].msg_hdr.msg_iov = &iov[index];
+        in[index].msg_hdr.msg_iovlen = 1;
+    }
+
+    count = recvmmsg(so, in, MEDIA_BATCH, MSG_DONTWAIT, NULL);
+    if(count < 1)
+        return false;
+
+    if(!local.ss_family)
+        return count == MEDIA_BATCH;
+
+    usec = latency::now() / 1000l;
+    time(&now);
+    memset(out, 0, sizeof(out));
+    for(index = 0; index < count; ++index) {
+        wp = (struct sockaddr *)&from[index];
+        if(Socket::equal(wp, (struct sockaddr *)&local)) {
+            memcpy(&to[index], &remote, sizeof(remote));
+            path[relayed] = &sent;
+        }
+        else {
+            Socket::store(&remote, wp);
+            memcpy(&to[index], &local, sizeof(local));
+            path[relayed] = &received;
+        }
+        if(in[index].msg_hdr.msg_flags & MSG_TRUNC) {
+            ++path[relayed]->errors;
+            continue;
+        }
+        path[relayed]->update((uint8_t *)buffers[index], in[index].msg_len, usec, now);
+        iov[index].iov_len = in[index].msg_len;
+        out[relayed].msg_hdr.msg_name = &to[index];
+        out[relayed].msg_hdr.msg_namelen = Socket::len((struct sockaddr *)&to[index]);
+        out[relayed].msg_hdr.msg_iov = &iov[index];
+        out[relayed].msg_hdr.msg_iovlen = 1;
+        ++relayed;
+    }
+
+#ifdef  UDP_SEGMENT
+    if(segment(so, out, relayed))
+        sending = relayed;
+#endif
+
+    // sendmmsg stops at the first packet it cannot send; that one is
+    // counted and skipped, and the rest of the batch is sent after it.
+    while(sending < relayed) {
+        result = sendmmsg(so, out + sending, relayed - sending, 0);
+        if(result < 1) {
+            ++path[sending++]->errors;
+            continue;
+        }
+        sending += result;
+    }
+
+    // a full batch means more may be waiting
+    return count == MEDIA_BATCH;
+}
+#else
+bool media::proxy::copy(void)
+{
+    char buffer[MEDIA_PACKET];
+    struct sockaddr_storage where;
+    struct sockaddr *wp = (struct sockaddr *)&where;
+    stream *path;
+    int flags = 0;
+
+#ifdef  MSG_TRUNC
+    // the full length of a datagram is returned, so one cut short is seen
+    flags = MSG_TRUNC;
+#endif
+
+    ssize_t count = Socket::recvfrom(so, buffer, sizeof(buffer), flags, &where);
+
+    if(count < 1)
+        return false;
+
+    if(!local.ss_family)
+        return true;
+
+    uint64_t usec = latency::now() / 1000l;
+    time_t now;
+    time(&now);
+
+    if(Socket::equal(wp, (struct sockaddr *)&local))
+        path = &sent;
+    else {
+        path = &received;
+        Socket::store(&remote, wp);
     }
+
+    if(count > (ssize_t)sizeof(buffer)) {
+        ++path->errors;
+        return true;
+    }
+
+    path->update((uint8_t *)buffer, count, usec, now);
+    if(path == &sent)
+        wp = (struct sockaddr *)&remote;
+    else
+        wp = (struct sockaddr *)&local;
+    if(Socket::sendto(so, buffer, count, 0, wp) < 1)
+        ++path->errors;
+    return true;
+}
+#endif
+
+// the caller sets the port on host, since a proxy activated before the
+// sdp named a media level address has no port of its own yet.
+void media::proxy::reconnect(struct sockaddr *host)
+{
+    owner->shard.acquire();
     Socket::store(&local, host);
+    owner->shard.release();
 }
 
 bool media::proxy::activate(media::sdp *parser)
@@ -190,253 +759,415 @@ bool media::proxy::activate(media::sdp *parser)
     struct sockaddr *iface = parser->peering;
     struct sockaddr *host = (struct sockaddr *)&parser->local;
 
-    release(0);
+    if(so == INVALID_SOCKET)
+        owner = media::thread::assign();
+
+    owner->shard.acquire();
+    setport(host, parser->mediaport);
+    setport(iface, port);
     Socket::store(&local, host);
 
-    switch(iface->sa_family) {
-#ifdef  AF_INET6
-    case AF_INET6:
-        so = Socket::create(AF_INET6, SOCK_DGRAM, 0);
-        ((struct sockaddr_in6*)(host))->sin6_port = htons(++parser->mediaport);
-        ((struct sockaddr_in6*)(iface))->sin6_port = htons(port);
-        break;
-#endif
-    case AF_INET:
-        so = Socket::create(AF_INET, SOCK_DGRAM, 0);
-        ((struct sockaddr_in*)(host))->sin_port = htons(++parser->mediaport);
-        ((struct sockaddr_in*)(iface))->sin_port = htons(port);
+    memset(&remote, 0, sizeof(remote));
+    memset(&sent, 0, sizeof(sent));
+    memset(&received, 0, sizeof(received));
+    time(&activated);
+
+    // a proxy from an interface stack is still bound and registered
+    if(so != INVALID_SOCKET) {
+        owner->shard.release();
+        return true;
     }
 
-    if(so == INVALID_SOCKET)
+    so = Socket::create(iface->sa_family, SOCK_DGRAM, 0);
+    if(so == INVALID_SOCKET) {
+        owner->shard.release();
         return false;
+    }
 
-    memset(&remote, 0, sizeof(remote));
     Socket::store(&peering, iface);
     Socket::bindto(so, iface);
+#ifdef  HAVE_SYS_EPOLL_H
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = this;
+    fcntl(so, F_SETFL, fcntl(so, F_GETFL) | O_NONBLOCK);
+    if(epoll_ctl(owner->epfd, EPOLL_CTL_ADD, so, &ev)) {
+        Socket::release(so);
+        so = INVALID_SOCKET;
+        owner->shard.release();
+        return false;
+    }
+#else
     FD_SET(so, &connections);
     if(so >= (socket_t)hiwater)
         hiwater = so + 1;
     proxymap[so] = this;
+#endif
+    owner->shard.release();
     return true;
 }
 
-void media::proxy::release(time_t expire)
+void media::proxy::reset(void)
 {
-    expire = expires;
-    if(expire || so == INVALID_SOCKET)
+    expires = 0l;
+    if(so == INVALID_SOCKET)
         return;
 
+    // packets arriving while pooled are dropped by copy()
+    owner->shard.acquire();
+    memset(&local, 0, sizeof(local));
+    memset(&remote, 0, sizeof(remote));
+    owner->shard.release();
+}
+
+void media::proxy::close(void)
+{
+    if(so == INVALID_SOCKET)
+        return;
+
+    owner->shard.acquire();
+#ifdef  HAVE_SYS_EPOLL_H
+    epoll_ctl(owner->epfd, EPOLL_CTL_DEL, so, NULL);
+#else
     FD_CLR(so, &connections);
     proxymap[so] = NULL;
+#endif
     Socket::release(so);
     so = INVALID_SOCKET;
+    owner->shard.release();
 }
 
 media::sdp::sdp()
 {
     outdata = result = NULL;
     bufdata = NULL;
-    mediacount = 0;
+    outsize = outpos = 0;
     mediaport = 0;
     nat = NULL;
+    peering = NULL;
+    rtp = NULL;
+    mux = rtcp = false;
+    address[0] = 0;
+    family = "IP4";
     memset(&local, 0, sizeof(local));
     memset(&top, 0, sizeof(local));
 }
 
 media::sdp::sdp(const char *source, char *target, size_t len)
 {
+    mediaport = 0;
+    nat = NULL;
+    peering = NULL;
+    rtp = NULL;
+    mux = rtcp = false;
+    address[0] = 0;
+    family = "IP4";
+    memset(&local, 0, sizeof(local));
+    memset(&top, 0, sizeof(local));
     set(source, target, len);
 }
 
-void media::sdp::reconnect(void)
-{
-    linked_pointer<media::proxy> pp = *nat;
-
-    while(is(pp) && mediacount--) {
-        pp->reconnect((struct sockaddr *)&local);
-        pp.next();
-    }
-    memcpy(&local, &top, sizeof(local));
-}
-
 void media::sdp::set(const char *source, char *target, size_t len)
 {
     outdata = result = target;
     bufdata = source;
+    outsize = len;
     outpos = 0;
+    if(outdata && outsize)
+        *outdata = 0;
 }
 
-char *media::sdp::get(char *buffer, size_t len)
+void media::sdp::put(const char *text, size_t len)
 {
-    char *base = buffer;
-    size_t blen = len;
+    if(!result)
+        return;
 
-    // if eod, return NULL
-    if(!bufdata || *bufdata == 0) {
-        *buffer = 0;
-        return NULL;
+    if(outpos + len >= outsize) {
+        result = NULL;
+        return;
     }
 
-    while(len > 1 && *bufdata != 0) {
-        if(*bufdata == '\r') {
-            ++bufdata;
-            continue;
-        }
-        else if(*bufdata == '\n') {
-            ++bufdata;
-            break;
-        }
-        *(buffer++) = *(bufdata++);
-        --len;
-    }
-    *buffer = 0;
-    check_connect(base, blen);
+    memcpy(outdata + outpos, text, len);
+    outpos += len;
+    outdata[outpos] = 0;
+}
 
-    if(!result)
-        return NULL;
+void media::sdp::put(const char *text)
+{
+    put(text, strlen(text));
+}
+
+media::proxy *media::sdp::attach(unsigned short port)
+{
+    media::proxy *pp;
+
+    mediaport = port;
+    lock.acquire();
+    pp = media::get(this);
+    lock.release();
 
-    return base;
+    if(!pp)
+        result = NULL;
+    return pp;
 }
 
-void media::sdp::check_media(char *buffer, size_t len)
+// activates the rtcp proxy paired with the stream's rtp proxy, leaving
+// mediaport as the rtp port for any c= line that follows.
+media::proxy *media::sdp::control(unsigned short port)
 {
-    char *cp, *ep, *sp;
-    char tmp[128];
-    char mtype[32];
-    unsigned tport;
-    unsigned tcount = 1;
     media::proxy *pp;
+    unsigned short saved = mediaport;
 
-    if(strnicmp(buffer, "m=", 2))
-        return;
+    mediaport = port;
+    lock.acquire();
+    pp = media::pair(this, rtp);
+    lock.release();
+    mediaport = saved;
 
-    cp = sp = strchr(buffer, ' ');
-    if(!cp)
-        return;
+    if(!pp)
+        result = NULL;
+    return pp;
+}
 
-    while(isspace(*cp))
+// c=IN IP4 address[/ttl]; names the endpoint for the session, or for the
+// current media stream, and is replaced by our own peering address.
+void media::sdp::connect(const char *line, size_t len)
+{
+    char text[64];
+    size_t pos = 0;
+    const char *cp = line + 2;
+    const char *ep = line + len;
+    const struct sockaddr *hp;
+    struct sockaddr_storage host;
+
+    // skip network and address type
+    for(unsigned field = 0; field < 2; ++field) {
+        while(cp < ep && isspace(*cp))
+            ++cp;
+        while(cp < ep && !isspace(*cp))
+            ++cp;
+    }
+    while(cp < ep && isspace(*cp))
         ++cp;
+    while(cp < ep && *cp != '/' && !isspace(*cp) && pos < sizeof(text) - 1)
+        text[pos++] = *(cp++);
+    text[pos] = 0;
 
-    tport = atoi(cp);
-    if(!tport)
+    // a host name cannot be relayed to, nor passed on beside our ports
+    if(!pos || !Socket::is_numeric(text)) {
+        result = NULL;
         return;
+    }
 
-    ep = strchr(cp, '/');
-    if(ep)
-        tcount = atoi(ep + 1);
-
-    // at the moment we can only do rtp/rtcp pairs...
-    if(tcount > 2) {
+    Socket::address addr(text);
+    hp = addr.getAddr();
+    if(!hp) {
         result = NULL;
         return;
     }
 
-    mediacount = tcount;
-    tcount = align(tcount);
+    Socket::store(&local, hp);
+    if(rtp) {
+        Socket::store(&host, hp);
+        setport((struct sockaddr *)&host, mediaport);
+        rtp->reconnect((struct sockaddr *)&host);
+    }
+    else
+        Socket::store(&top, hp);
+
+    snprintf(text, sizeof(text), "c=IN %s ", family);
+    put(text);
+    put(address);
+    put("\r\n", 2);
+}
 
-    ep = strchr(cp, ' ');
-    if(!ep)
-        ep = (char *)"";
-    else while(isspace(*ep))
-        ++ep;
+// m=type port[/count] proto fmt...; a stream is given its rtp proxy here.
+void media::sdp::open(const char *line, size_t len)
+{
+    char text[16];
+    const char *cp = line + 2;
+    const char *ep = line + len;
+    const char *pp;
+    unsigned port = 0;
 
-    mediaport = tport;
-    mediacount = tcount;
-    tport = 0;
+    memcpy(&local, &top, sizeof(local));
+    mux = rtcp = false;
+    rtp = NULL;
 
-    lock.acquire();
-    String::set(tmp, sizeof(tmp), ep);
-    while(tcount--) {
-        pp = media::get(this);
-        if(!pp) {
-            result = NULL;
-            lock.release();
-            return;
-        }
-        if(!tport)
-            tport = (pp->port / 2) * 2;
+    while(cp < ep && !isspace(*cp))
+        ++cp;
+    pp = cp;
+    while(cp < ep && isspace(*cp))
+        ++cp;
+    while(cp < ep && isdigit(*cp))
+        port = port * 10 + (*(cp++) - '0');
+
+    // we can only relay one port per stream
+    if(cp < ep && *cp == '/' && atoi(cp + 1) > 1) {
+        result = NULL;
+        return;
     }
-    lock.release();
 
-    *sp = 0;
-    String::set(mtype, sizeof(mtype), buffer);
-    if(mediacount > 1)
-        snprintf(buffer, len, "%s %u/%u %s",
-            mtype, tport, mediacount, tmp);
-    else
-        snprintf(buffer, len, "%s %u %s",
-            mtype, tport, tmp);
+    // disabled streams are passed through as is
+    if(!port || port > 65535) {
+        put(line, len);
+        put("\r\n", 2);
+        return;
+    }
 
-    mediacount = align(mediacount);
+    rtp = attach(port);
+    if(!rtp)
+        return;
+
+    snprintf(text, sizeof(text), " %u", rtp->port);
+    put(line, pp - line);
+    put(text);
+    put(cp, ep - cp);
+    put("\r\n", 2);
 }
 
-void media::sdp::check_connect(char *buffer, size_t len)
+// a=rtcp:port [IN IP4 address] is pointed at the rtcp proxy of the pair,
+// and a=rtcp-mux means rtcp shares the rtp proxy.
+void media::sdp::attribute(const char *line, size_t len)
 {
-    char *cp = buffer + 4;
-    char *ap;
-    char ttl[16];
+    char text[80];
+    const char *cp = line + 7;
+    const char *ep = line + len;
     const struct sockaddr *hp;
+    struct sockaddr_storage host;
+    media::proxy *pp;
+    unsigned port = 0;
+    size_t pos = 0;
+
+    if(len == 10 && !strnicmp(line, "a=rtcp-mux", 10))
+        mux = true;
 
-    if(strnicmp(buffer, "c=in", 4))
+    if(!rtp || len < 8 || strnicmp(line, "a=rtcp:", 7)) {
+        put(line, len);
+        put("\r\n", 2);
         return;
+    }
+
+    while(cp < ep && isdigit(*cp))
+        port = port * 10 + (*(cp++) - '0');
 
-    while(isspace(*cp))
+    // an explicit address follows the port as "IN IP4 address"
+    for(unsigned field = 0; field < 2 && cp < ep; ++field) {
+        while(cp < ep && isspace(*cp))
+            ++cp;
+        while(cp < ep && !isspace(*cp))
+            ++cp;
+    }
+    while(cp < ep && isspace(*cp))
         ++cp;
+    while(cp < ep && !isspace(*cp) && pos < sizeof(text) - 1)
+        text[pos++] = *(cp++);
+    text[pos] = 0;
 
-    if(ipv6 && strnicmp(cp, "ip6", 3))
-        return;
-    else if(!ipv6 && strnicmp(cp, "ip4", 3))
+    if(!port || port > 65535 || rtcp) {
+        result = NULL;
         return;
+    }
 
-    ap = cp + 3;
-    while(isspace(*ap))
-        ++ap;
+    pp = control(port);
+    if(!pp)
+        return;
 
-    cp = strchr(ap, '/');
-    if(cp) {
-        String::set(ttl, sizeof(ttl), cp);
-        *cp = 0;
+    rtcp = true;
+    if(pos && Socket::is_numeric(text)) {
+        Socket::address addr(text);
+        hp = addr.getAddr();
+        if(hp) {
+            Socket::store(&host, hp);
+            setport((struct sockaddr *)&host, port);
+            pp->reconnect((struct sockaddr *)&host);
+        }
     }
-    else
-        ttl[0] = 0;
 
-    if(!Socket::is_numeric(ap)) {
-invalid:
-        *cp = '/';
+    snprintf(text, sizeof(text), "a=rtcp:%u IN %s ", pp->port, family);
+    put(text);
+    put(address);
+    put("\r\n", 2);
+}
+
+// end of a media stream; rtcp goes to rtp port + 1 unless the sdp said
+// otherwise, so the rtcp proxy of the pair relays that, announced with
+// a=rtcp.
+void media::sdp::close(void)
+{
+    char text[80];
+    media::proxy *pp;
+
+    if(!rtp || !result || mux || rtcp) {
+        rtp = NULL;
         return;
     }
 
-    Socket::address addr(ap);
-    hp = addr.getAddr();
-    if(!hp)
-        goto invalid;
-
-    Socket::store(&local, hp);
-    if(!mediaport)
-        Socket::store(&top, hp);
-    else
-        reconnect();
+    pp = control(mediaport + 1);
+    rtp = NULL;
+    if(!pp)
+        return;
 
-    Socket::query((struct sockaddr *)&peering, ap, len - 8);
-    String::add(buffer, len, ttl);
+    snprintf(text, sizeof(text), "a=rtcp:%u IN %s ", pp->port, family);
+    put(text);
+    put(address);
+    put("\r\n", 2);
 }
 
-size_t media::sdp::put(char *buffer)
+char *media::sdp::rewrite(void)
 {
-    size_t outsize = 0;
+    const char *line, *ep;
+    size_t len;
 
-    if(!outdata)
-        return 0;
+    if(!result || !bufdata || !peering)
+        return NULL;
 
-    while(*buffer && outpos < (MAX_SDP_BUFFER - 2)) {
-        ++outsize;
-        *(outdata++) = *(buffer++);
-    }
+    Socket::query(peering, address, sizeof(address));
+    if(peering->sa_family == AF_INET)
+        family = "IP4";
+    else
+        family = "IP6";
+
+    while(result && *bufdata) {
+        line = bufdata;
+        ep = strchr(line, '\n');
+        if(ep)
+            bufdata = ep + 1;
+        else
+            bufdata = ep = line + strlen(line);
 
-    *(outdata++) = '\r';
-    *(outdata++) = '\n';
-    *outdata = 0;
-    return outsize + 2;
+        len = ep - line;
+        if(len && line[len - 1] == '\r')
+            --len;
+
+        if(!len)
+            continue;
+
+        if(len < 2 || line[1] != '=') {
+            put(line, len);
+            put("\r\n", 2);
+            continue;
+        }
+
+        switch(tolower(line[0])) {
+        case 'm':
+            close();
+            open(line, len);
+            break;
+        case 'c':
+            connect(line, len);
+            break;
+        case 'a':
+            attribute(line, len);
+            break;
+        default:
+            put(line, len);
+            put("\r\n", 2);
+        }
+    }
+    close();
+    return result;
 }
 
 media::media() :
@@ -456,7 +1187,8 @@ void media::reload(service *cfg)
     if(is_configured())
         return;
 
-    baseport = sip_port + 2;
+    // rtp ports are even, with rtcp on the odd port above
+    baseport = align(sip_port + 2);
 
     linked_pointer<service::keynode> mp = cfg->getList("media");
     const char *key = NULL, *value;
@@ -471,6 +1203,14 @@ void media::reload(service *cfg)
                 tpriority = atoi(value);
             else if(!stricmp(key, "count"))
                 portcount = align(atoi(value));
+            else if(!stricmp(key, "timeout"))
+                inactivity = atoi(value);
+#ifdef  HAVE_SYS_EPOLL_H
+            else if(!stricmp(key, "threads") && atoi(value) > 0)
+                threads = atoi(value);
+            else if(!stricmp(key, "affinity"))
+                String::set(affinity, sizeof(affinity), value);
+#endif
         }
         mp.next();
     }
@@ -478,6 +1218,10 @@ void media::reload(service *cfg)
         shell::log(DEBUG2, "media proxy configured for %d ports", portcount);
     else
         shell::log(DEBUG1, "media proxy disabled");
+#ifdef  HAVE_SYS_EPOLL_H
+    if(portcount && threads > 1)
+        shell::log(DEBUG2, "media proxy using %d threads", threads);
+#endif
 }
 
 void media::start(service *cfg)
@@ -487,6 +1231,7 @@ void media::start(service *cfg)
     else
         return;
 
+#ifndef HAVE_SYS_EPOLL_H
     memset(proxymap, 0, sizeof(proxymap));
     memset(&connections, 0, sizeof(connections));
 
@@ -499,9 +1244,13 @@ void media::start(service *cfg)
 
     FD_SET(control[0], &connections);
     hiwater = control[0] + 1;
+#endif
 #endif
 
+    // only the rtp proxy of each pair goes on the free stacks
     list = new media::proxy[portcount];
+    for(unsigned index = portcount; index > 0; index -= 2)
+        list[index - 2].enlist(&unbound);
 
     thread::startup();
 }
@@ -517,6 +1266,22 @@ void media::stop(service *cfg)
     delete[] list;
 }
 
+void media::loopback(unsigned ports, unsigned count)
+{
+    baseport = 20000;
+    portcount = align(ports) * 2;
+#ifdef  HAVE_SYS_EPOLL_H
+    if(count)
+        threads = count;
+#endif
+    _proxy.start(NULL);
+}
+
+void media::shutdown(void)
+{
+    _proxy.stop(NULL);
+}
+
 void media::enableIPV6(void)
 {
     ipv6 = true;
@@ -524,28 +1289,56 @@ void media::enableIPV6(void)
 
 media::proxy *media::get(media::sdp *parser)
 {
-    time_t now;
-    time(&now);
+    unsigned index = ifpool(parser->peering);
+    media::proxy *pp = NULL;
 
-    linked_pointer<media::proxy> pp = runlist;
-    while(is(pp)) {
-        if(pp->expires && pp->expires < now)
-            pp->release(0);
-
-        if(pp->so == INVALID_SOCKET && !pp->fw) {
-            if(pp->activate(parser))
-            {
-                pp->delist(&runlist);
-                media::thread::notify();
-                pp->enlist(parser->nat);
-                return *pp;
-            }
-            else
-                break;
+    if(index < ifcount)
+        pp = pop(&interfaces[index].free);
+
+    if(!pp)
+        pp = pop(&unbound);
+
+    // take a bound proxy from another interface if nothing else is free
+    for(index = 0; !pp && index < ifcount; ++index) {
+        pp = pop(&interfaces[index].free);
+        if(pp) {
+            pp->close();
+            (pp + 1)->close();
         }
-        pp.next();
     }
-    return NULL;
+
+    if(!pp)
+        return NULL;
+
+    if(!pp->activate(parser)) {
+        pp->close();
+        (pp + 1)->close();
+        pp->enlist(&unbound);
+        return NULL;
+    }
+
+#ifndef HAVE_SYS_EPOLL_H
+    media::thread::notify();
+#endif
+    pp->enlist(parser->nat);
+    return pp;
+}
+
+media::proxy *media::pair(media::sdp *parser, media::proxy *rtp)
+{
+    media::proxy *pp = rtp + 1;
+
+    // the rtp proxy stays on the call, and takes this back with it
+    if(!pp->activate(parser)) {
+        pp->close();
+        return NULL;
+    }
+
+#ifndef HAVE_SYS_EPOLL_H
+    media::thread::notify();
+#endif
+    pp->enlist(parser->nat);
+    return pp;
 }
 
 void media::release(LinkedObject **nat, unsigned expires)
@@ -568,14 +1361,126 @@ void media::release(LinkedObject **nat, unsigned expires)
     while(is(pp)) {
         member = *pp;
         pp.next();
-        member->release(expires);
-        member->enlist(&runlist);
+        if(expire) {
+            member->expires = expire;
+            member->enlist(&expiring);
+        }
+        else
+            recycle(member);
     }
     lock.release();
 
     *nat = NULL;
 }
 
+void media::cleanup(void)
+{
+    proxy *member;
+    time_t now;
+
+    if(!expiring)
+        return;
+
+    time(&now);
+    lock.acquire();
+    linked_pointer<proxy> pp = expiring;
+    while(is(pp)) {
+        member = *pp;
+        pp.next();
+        if(member->expires && member->expires < now) {
+            member->delist(&expiring);
+            recycle(member);
+        }
+    }
+    lock.release();
+}
+
+static void accumulate(cdr::media_t *total, media::proxy::stream *from)
+{
+    total->packets += from->packets;
+    total->bytes += from->bytes;
+    total->lost += from->lost;
+    total->errors += from->errors;
+    if((from->jitter >> 4) > total->jitter)
+        total->jitter = from->jitter >> 4;
+    if(from->last > total->last)
+        total->last = from->last;
+}
+
+void media::collect(LinkedObject *nat, cdr::media_t *sent, cdr::media_t *received)
+{
+    media::proxy *pp;
+
+    lock.acquire();
+    linked_pointer<proxy> mp = nat;
+    while(is(mp)) {
+        pp = *mp;
+        if(pp->owner) {
+            pp->owner->shard.acquire();
+            accumulate(sent, &pp->sent);
+            accumulate(received, &pp->received);
+            pp->owner->shard.release();
+        }
+        mp.next();
+    }
+    lock.release();
+}
+
+static void combine(cdr::media_t *total, cdr::media_t *from)
+{
+    total->packets += from->packets;
+    total->bytes += from->bytes;
+    total->lost += from->lost;
+    total->errors += from->errors;
+    if(from->jitter > total->jitter)
+        total->jitter = from->jitter;
+    if(from->last > total->last)
+        total->last = from->last;
+}
+
+// totals carried by the session are only changed under the lock, by
+// collect() just before a re-invite releases its proxies.
+void media::collect(stack::session *session, cdr::media_t *sent, cdr::media_t *received)
+{
+    lock.acquire();
+    combine(sent, &session->sent);
+    combine(received, &session->received);
+    lock.release();
+
+    collect(session->nat, sent, received);
+}
+
+bool media::isIdle(LinkedObject *nat)
+{
+    media::proxy *pp;
+    time_t now, last;
+    bool idle = true;
+
+    if(!nat || !inactivity)
+        return false;
+
+    time(&now);
+    lock.acquire();
+    linked_pointer<proxy> mp = nat;
+    while(idle && is(mp)) {
+        pp = *mp;
+        if(pp->owner)
+            pp->owner->shard.acquire();
+        last = pp->activated;
+        if(pp->sent.last > last)
+            last = pp->sent.last;
+        if(pp->received.last > last)
+            last = pp->received.last;
+        if(pp->owner)
+            pp->owner->shard.release();
+        if(last + (time_t)inactivity > now)
+            idle = false;
+        mp.next();
+    }
+    lock.release();
+    return idle;
+}
+
 bool media::isProxied(const char *source, const char *target, struct sockaddr_storage *peering)
 {
     assert(source != NULL);
@@ -611,6 +1516,20 @@ bool media::isProxied(const char *source, const char *target, struct sockaddr_st
         return true;
     }
 
+    unsigned key = pathkey(source, target);
+    unsigned current = generation;
+
+    pathlock.access();
+    if(paths[key].generation == current && paths[key].ipv6 == ipv6 &&
+      String::equal(paths[key].source, source) && String::equal(paths[key].target, target)) {
+        proxy = paths[key].proxy;
+        if(proxy)
+            memcpy(peering, &paths[key].peering, sizeof(struct sockaddr_storage));
+        pathlock.release();
+        return proxy;
+    }
+    pathlock.release();
+
     // get subnets from policy name
     stack::subnet *src = server::getSubnet(source);
     stack::subnet *dst = server::getSubnet(target);
@@ -627,11 +1546,30 @@ bool media::isProxied(const char *source, const char *target, struct sockaddr_st
 exit:
     server::release(src);
     server::release(dst);
-    // will become true later...
+
+    // unknown subnets are not cached, since they may yet be configured
+    if(src && dst) {
+        pathlock.modify();
+        String::set(paths[key].source, sizeof(paths[key].source), source);
+        String::set(paths[key].target, sizeof(paths[key].target), target);
+        paths[key].generation = current;
+        paths[key].ipv6 = ipv6;
+        paths[key].proxy = proxy;
+        if(proxy)
+            memcpy(&paths[key].peering, peering, sizeof(struct sockaddr_storage));
+        pathlock.release();
+    }
     return proxy;
 }
 
-char *media::reinvite(stack::session *session, const char *sdpin)
+void media::invalidate(void)
+{
+    pathlock.modify();
+    ++generation;
+    pathlock.release();
+}
+
+const char *media::reinvite(stack::session *session, const char *sdpin)
 {
     assert(session != NULL);
     assert(sdpin != NULL);
@@ -646,24 +1584,27 @@ char *media::reinvite(stack::session *session, const char *sdpin)
     else
         target = cr->source;
 
-    // in case we had a nat chain...
+    // in case we had a nat chain, whose media still counts for the call
     nat = &target->nat;
+    media::collect(*nat, &target->sent, &target->received);
     media::release(nat, 2);
 
     if(!isProxied(session->network, target->network, &peering)) {
-        String::set(session->sdp, sizeof(session->sdp), sdpin);
-        return session->sdp;
+        return cr->setSDP(session, sdpin);
     }
 
     shell::log(DEBUG3, "reinvite proxied %s to %s", session->network, target->network);
-    sdp parser(sdpin, session->sdp, sizeof(session->sdp));
+    char sdpout[MAX_SDP_BUFFER];
+    sdp parser(sdpin, sdpout, sizeof(sdpout));
     parser.peering = (struct sockaddr *)&peering;
     parser.nat = nat;
 
-    return rewrite(&parser);
+    if(!rewrite(&parser))
+        return NULL;
+    return cr->setSDP(session, sdpout);
 }
 
-char *media::answer(stack::session *session, const char *sdpin)
+const char *media::answer(stack::session *session, const char *sdpin)
 {
     assert(session != NULL);
     assert(sdpin != NULL);
@@ -676,21 +1617,24 @@ char *media::answer(stack::session *session, const char *sdpin)
     if(session == target || (cr->target != NULL && cr->target != session))
         return NULL;
 
-    // in case we had a nat chain...
+    // in case we had a nat chain, whose media still counts for the call
     nat = &target->nat;
+    media::collect(*nat, &target->sent, &target->received);
     media::release(nat, 2);
 
     if(!isProxied(session->network, target->network, &peering)) {
-        String::set(session->sdp, sizeof(session->sdp), sdpin);
-        return session->sdp;
+        return cr->setSDP(session, sdpin);
     }
 
     shell::log(DEBUG3, "answer proxied %s to %s", session->network, target->network);
-    sdp parser(sdpin, session->sdp, sizeof(session->sdp));
+    char sdpout[MAX_SDP_BUFFER];
+    sdp parser(sdpin, sdpout, sizeof(sdpout));
     parser.peering = (struct sockaddr *)&peering;
     parser.nat = nat;
 
-    return rewrite(&parser);
+    if(!rewrite(&parser))
+        return NULL;
+    return cr->setSDP(session, sdpout);
 }
 
 char *media::invite(stack::session *session, const char *target, LinkedObject **nat, char *sdpout, size_t size)
@@ -717,15 +1661,7 @@ char *media::invite(stack::session *session, const char *target, LinkedObject **
 
 char *media::rewrite(media::sdp *parser)
 {
-    char buffer[256];
-
-    // simple copy rewrite parser for now....
-    while(NULL != parser->get(buffer, sizeof(buffer))) {
-        if(!parser->put(buffer))
-            return NULL;
-
-    }
-    return parser->result;
+    return parser->rewrite();
 }
 
 } // end namespace
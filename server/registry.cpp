@@ -18,29 +18,516 @@
 
 namespace sipwitch {
 
-static volatile unsigned active_routes = 0;
+// Registry expiry is driven from a two level timing wheel.  The inner wheel
+// has one second buckets, the outer wheel holds a full inner rotation per
+// bucket, and anything further out parks in the last outer bucket until it
+// cascades closer.  Nodes are only hints; the entry itself is re-checked
+// under its stripe when a node comes due.
+
+#define WHEEL_INNER 256
+#define WHEEL_OUTER 64
+
+// Registry index tables resize online.  When the load factor leaves its
+// band a new bucket array is made and the old one is drained a few buckets
+// at a time on each later insert or remove, so no single update pays for a
+// full rehash.  A key lives in the prior array until its bucket is moved.
+
+#define TABLE_GROWTH    2
+#define TABLE_SHRINK    8
+#define TABLE_STEPS     4
+
+#if defined(_MSC_VER)
+#define REGISTRY_LOCAL  __declspec(thread)
+#else
+#define REGISTRY_LOCAL  __thread
+#endif
+
+#define REGISTRY_HELD   8       // entries one thread may hold at once
+
+class __LOCAL keytable
+{
+public:
+    typedef unsigned (*keyhash_t)(LinkedObject *node);
+
+private:
+    LinkedObject **table, **prior;
+    unsigned size, priorsize, minsize, moving, count;
+    keyhash_t keyhash;
+
+    void resize(unsigned newsize);
+    void step(void);
+
+public:
+    keytable(keyhash_t hashing);
+
+    void create(unsigned initial);
+    LinkedObject **path(unsigned hash) const;
+    void enlist(LinkedObject *node, unsigned hash);
+    void delist(LinkedObject *node, unsigned hash);
+    void snapshot(FILE *fp, const char *id) const;
+
+    inline LinkedObject *operator()(unsigned hash) const
+        {return *path(hash);}
+};
+
+class __LOCAL expiring : public LinkedObject
+{
+public:
+    unsigned index;
+    time_t when;
+
+    static void *operator new(size_t size);
+    static void operator delete(void *ptr);
+
+    static slab pool;
+};
+
+// Registrations are checkpointed to a flat image in the prefix directory
+// from the background cleanup pass and when the registry stops, one
+// record per active contact, and replayed
+// once the sip stack is up again so endpoints do not need to re-register
+// after a restart.  The record size is kept in the header so an image from
+// a differently built server is ignored rather than misread.
+
+#define CHECKPOINT_FILE     "registry.chk"
+#define CHECKPOINT_MAGIC    0x53575243
+
+typedef struct {
+    uint32_t magic;
+    uint32_t length;            // size of each lease record
+    uint32_t records;
+    time_t saved;
+} checkpoint_t;
+
+typedef struct {
+    char userid[MAX_USERID_SIZE];
+    registry::target::status_t status;
+    unsigned transport;         // 0 = default, 1 = udp, 2 = tcp, 3 = tls
+    unsigned long allows;
+    time_t registered;          // registry created
+    time_t created;             // contact created
+    time_t expires;
+    struct sockaddr_internet address;
+    struct sockaddr_storage peering;
+    char contact[MAX_URI_SIZE];
+    char network[MAX_NETWORK_SIZE];
+} lease_t;
+
 static volatile unsigned active_entries = 0;
-static volatile unsigned active_targets = 0;
 static volatile unsigned published_routes = 0;
-static volatile unsigned allocated_routes = 0;
-static volatile unsigned allocated_targets = 0;
 static volatile unsigned allocated_entries = 0;
 static unsigned mapped_entries = 999;
 
 static unsigned keysize = 177;
 static registry::mapped **extmap = NULL;
-static LinkedObject **addresses = NULL;
-static LinkedObject **publishing = NULL;
-static LinkedObject **contacts = NULL;
-static LinkedObject **primap = NULL;
-static LinkedObject *freeroutes = NULL;
-static LinkedObject *freetargets = NULL;
-static LinkedObject **keys = NULL;
-static condlock_t locking;
+static dialplan *routing = NULL;
+static unsigned long sequence = 0;
+static unsigned stripes = 64;
+static stripelock *striping = NULL;
+static rwlock_t indexing;
+static mutex_t wheeling;
+static LinkedObject *inner[WHEEL_INNER];
+static LinkedObject *outer[WHEEL_OUTER];
+static time_t *scheduled = NULL;
+static time_t current = 0;
 static stats *statmap = NULL;
 static LinkedObject *freelist = NULL;
+static lease_t *leases = NULL;
+static unsigned checkpointed = 0;
+static time_t saving = 60;
+static time_t saved = 0;
+static REGISTRY_LOCAL unsigned holds = 0;
+static REGISTRY_LOCAL registry::mapped *holding[REGISTRY_HELD];
 
 registry registry::reg;
+slab registry::target::pool("targets", sizeof(registry::target));
+slab registry::route::pool("routes", sizeof(registry::route));
+slab expiring::pool("timers", sizeof(expiring));
+
+// Registry entries are locked by stripe, selected from their slot in the
+// shared memory map, so unrelated lookups no longer contend.  The index
+// tables (keys, extmap, contacts, publishing, addresses, routing) and the
+// freelist are covered by a separate short-held leaf lock that is always
+// taken after any stripe lock.
+
+static stripelock *stripe(registry::mapped *rr)
+{
+    return &striping[registry::getIndex(rr) % stripes];
+}
+
+// A thread may hold several entries at once, such as the dialed target
+// and a forwarding destination, so the entries each thread holds are
+// tracked, and stripes are always taken in index order.  A lookup that
+// needs a lower stripe than one the thread already holds lets the higher
+// ones go, takes its own, and takes them back in order.  The entries let
+// go are pinned in use meanwhile so they cannot be expired, but their
+// targets and routes may change, so no caller keeps a target or route
+// iterator across another registry lookup.  Registrations and the
+// background thread hold no other entry when they take a stripe, and
+// invite() pins its entry under the index lock without taking any stripe.
+
+static registry::mapped *hold(registry::mapped *rr)
+{
+    if(holds < REGISTRY_HELD)
+        holding[holds++] = rr;
+    return rr;
+}
+
+static void unhold(registry::mapped *rr)
+{
+    unsigned index = holds;
+
+    while(index--) {
+        if(holding[index] == rr) {
+            holding[index] = holding[--holds];
+            return;
+        }
+    }
+}
+
+static void take(stripelock *lock)
+{
+    registry::mapped *rr;
+    bool parked[REGISTRY_HELD];
+    unsigned index, next;
+    bool later = false;
+
+    for(index = 0; index < holds; ++index) {
+        // a stripe we already share can always be shared again
+        if(stripe(holding[index]) == lock) {
+            lock->access();
+            return;
+        }
+        if(stripe(holding[index]) > lock)
+            later = true;
+    }
+
+    if(!later) {
+        lock->access();
+        return;
+    }
+
+    for(index = 0; index < holds; ++index) {
+        rr = holding[index];
+        parked[index] = (stripe(rr) > lock);
+        if(!parked[index])
+            continue;
+        mapped_modify(rr);
+        ++rr->inuse;
+        mapped_commit(rr);
+        stripe(rr)->release();
+    }
+
+    lock->access();
+
+    for(;;) {
+        next = holds;
+        for(index = 0; index < holds; ++index) {
+            if(parked[index] && (next == holds || stripe(holding[index]) < stripe(holding[next])))
+                next = index;
+        }
+        if(next == holds)
+            break;
+        rr = holding[next];
+        parked[next] = false;
+        stripe(rr)->access();
+        mapped_modify(rr);
+        --rr->inuse;
+        mapped_commit(rr);
+    }
+}
+
+static unsigned hashing(const char *id)
+{
+    unsigned hash = 2166136261u;
+
+    while(*id) {
+        hash ^= (unsigned)tolower(*(id++));
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static unsigned hashing(const struct sockaddr *addr)
+{
+    unsigned hash = 2166136261u;
+    const unsigned char *cp = NULL;
+    size_t len = 0;
+    uint16_t port = 0;
+
+    switch(addr->sa_family) {
+    case AF_INET:
+        cp = (const unsigned char *)&((const struct sockaddr_in *)addr)->sin_addr;
+        len = sizeof(struct in_addr);
+        port = ((const struct sockaddr_in *)addr)->sin_port;
+        break;
+#ifdef  AF_INET6
+    case AF_INET6:
+        cp = (const unsigned char *)&((const struct sockaddr_in6 *)addr)->sin6_addr;
+        len = sizeof(struct in6_addr);
+        port = ((const struct sockaddr_in6 *)addr)->sin6_port;
+        break;
+#endif
+    default:
+        break;
+    }
+
+    while(len--) {
+        hash ^= *(cp++);
+        hash *= 16777619u;
+    }
+    hash ^= port;
+    hash *= 16777619u;
+    return hash;
+}
+
+static unsigned userkey(LinkedObject *node)
+{
+    return hashing(static_cast<registry::mapped *>(node)->userid);
+}
+
+static unsigned patternkey(LinkedObject *node)
+{
+    return hashing(static_cast<registry::pattern *>(node)->text);
+}
+
+static unsigned addresskey(LinkedObject *node)
+{
+    return hashing(static_cast<registry::target::indexing *>(node)->address);
+}
+
+static keytable keys(&userkey);
+static keytable contacts(&patternkey);
+static keytable publishing(&patternkey);
+static keytable addresses(&addresskey);
+
+keytable::keytable(keyhash_t hashing)
+{
+    table = prior = NULL;
+    size = priorsize = minsize = moving = count = 0;
+    keyhash = hashing;
+}
+
+void keytable::create(unsigned initial)
+{
+    if(initial < 2)
+        initial = 2;
+    minsize = size = initial;
+    table = new LinkedObject *[size];
+    memset(table, 0, sizeof(LinkedObject *) * size);
+}
+
+LinkedObject **keytable::path(unsigned hash) const
+{
+    unsigned bucket;
+
+    if(prior) {
+        bucket = hash % priorsize;
+        if(bucket >= moving)
+            return &prior[bucket];
+    }
+    return &table[hash % size];
+}
+
+void keytable::resize(unsigned newsize)
+{
+    prior = table;
+    priorsize = size;
+    moving = 0;
+    size = newsize;
+    table = new LinkedObject *[size];
+    memset(table, 0, sizeof(LinkedObject *) * size);
+}
+
+void keytable::step(void)
+{
+    unsigned steps = TABLE_STEPS;
+    LinkedObject *node, *next;
+
+    if(!prior) {
+        if(count > size * TABLE_GROWTH)
+            resize(size * 2 + 1);
+        else if(size > minsize && count < size / TABLE_SHRINK)
+            resize(size / 2 > minsize ? size / 2 : minsize);
+        return;
+    }
+
+    while(steps-- && moving < priorsize) {
+        node = prior[moving];
+        prior[moving++] = NULL;
+        while(node) {
+            next = node->getNext();
+            node->enlist(&table[keyhash(node) % size]);
+            node = next;
+        }
+    }
+
+    if(moving >= priorsize) {
+        delete[] prior;
+        prior = NULL;
+        priorsize = moving = 0;
+    }
+}
+
+void keytable::enlist(LinkedObject *node, unsigned hash)
+{
+    step();
+    node->enlist(path(hash));
+    ++count;
+}
+
+void keytable::delist(LinkedObject *node, unsigned hash)
+{
+    node->delist(path(hash));
+    if(count)
+        --count;
+    step();
+}
+
+void keytable::snapshot(FILE *fp, const char *id) const
+{
+    unsigned used = 0, longest = 0, chain, index;
+    linked_pointer<LinkedObject> lp;
+
+    for(index = 0; index < size + priorsize; ++index) {
+        if(index < size)
+            lp = table[index];
+        else
+            lp = prior[index - size];
+        chain = 0;
+        while(is(lp)) {
+            ++chain;
+            lp.next();
+        }
+        if(chain)
+            ++used;
+        if(chain > longest)
+            longest = chain;
+    }
+
+    fprintf(fp, "  %s index: size=%d, entries=%d, load=%.2f, used=%d, chain=%.2f, longest=%d%s\n",
+        id, size, count, (double)count / (double)(size + priorsize),
+        used, used ? (double)count / (double)used : 0.0, longest,
+        prior ? ", resizing" : "");
+}
+
+static void place(expiring *node)
+{
+    time_t slot;
+
+    if(node->when < current + WHEEL_INNER) {
+        slot = node->when;
+        if(slot < current)
+            slot = current;
+        node->enlist(&inner[slot % WHEEL_INNER]);
+        return;
+    }
+
+    slot = node->when / WHEEL_INNER;
+    if(slot >= current / WHEEL_INNER + WHEEL_OUTER)
+        slot = current / WHEEL_INNER + WHEEL_OUTER - 1;
+    node->enlist(&outer[slot % WHEEL_OUTER]);
+}
+
+// an entry keeps at most one live node, at the earliest time it must be
+// looked at; extending a lease leaves the earlier node to re-arm itself.
+
+static void schedule(registry::mapped *rr, time_t when)
+{
+    unsigned index = registry::getIndex(rr);
+    expiring *node;
+
+    if(when < 1)
+        when = 1;
+
+    wheeling.acquire();
+    if(!scheduled[index] || when < scheduled[index]) {
+        node = new expiring;
+        node->index = index;
+        node->when = when;
+        scheduled[index] = when;
+        place(node);
+    }
+    wheeling.release();
+}
+
+static void unschedule(registry::mapped *rr)
+{
+    wheeling.acquire();
+    scheduled[registry::getIndex(rr)] = 0;
+    wheeling.release();
+}
+
+static LinkedObject *advance(time_t upto)
+{
+    LinkedObject *due = NULL, *list;
+    linked_pointer<expiring> tp;
+
+    wheeling.acquire();
+    while(current <= upto) {
+        if(!(current % WHEEL_INNER)) {
+            tp = outer[(current / WHEEL_INNER) % WHEEL_OUTER];
+            outer[(current / WHEEL_INNER) % WHEEL_OUTER] = NULL;
+            while(is(tp)) {
+                expiring *next = static_cast<expiring *>(tp->getNext());
+                place(*tp);
+                tp = next;
+            }
+        }
+        list = inner[current % WHEEL_INNER];
+        inner[current % WHEEL_INNER] = NULL;
+        while(list) {
+            LinkedObject *next = list->getNext();
+            list->enlist(&due);
+            list = next;
+        }
+        ++current;
+    }
+    wheeling.release();
+    return due;
+}
+
+static unsigned transport(voip::context_t context)
+{
+    if(!context)
+        return 0;
+
+    if(stack::isDatagram(context))
+        return 1;
+
+    if(context == stack::sip.tcp_context)
+        return 2;
+
+    if(context == stack::sip.tls_context)
+        return 3;
+
+    return 0;
+}
+
+static voip::context_t transport(unsigned code)
+{
+    switch(code) {
+    case 1:
+        return stack::sip.udp_context;
+    case 2:
+        return stack::sip.tcp_context;
+    case 3:
+        return stack::sip.tls_context;
+    default:
+        return NULL;
+    }
+}
+
+static bool matching(registry::mapped *rr, const char *id, unsigned ext)
+{
+    if(String::equal(rr->userid, id))
+        return true;
+
+    if(ext && rr->ext == ext)
+        return true;
+
+    return false;
+}
 
 registry::pointer::pointer()
 {
@@ -57,7 +544,10 @@ registry::pointer::pointer(const char *id)
 registry::pointer::pointer(pointer const &copy)
 {
     entry = copy.entry;
-    locking.access();
+    if(entry && entry->type != MappedRegistry::EXTERNAL) {
+        take(stripe(entry));
+        hold(entry);
+    }
 }
 
 registry::pointer::~pointer()
@@ -75,32 +565,42 @@ void *registry::target::operator new(size_t size)
 {
     assert(size == sizeof(registry::target));
 
-    ++active_targets;
-    return server::allocate(size, &freetargets, &allocated_targets);
+    return pool.alloc();
 }
 
 void registry::target::operator delete(void *obj)
 {
     assert(obj != NULL);
 
-    ((LinkedObject*)(obj))->enlist(&freetargets);
-    --active_targets;
+    pool.release(obj);
 }
 
 void *registry::route::operator new(size_t size)
 {
     assert(size == sizeof(registry::route));
 
-    ++active_routes;
-    return server::allocate(size, &freeroutes, &allocated_routes);
+    return pool.alloc();
 }
 
 void registry::route::operator delete(void *obj)
 {
     assert(obj != NULL);
 
-    ((LinkedObject*)(obj))->enlist(&freeroutes);
-    --active_routes;
+    pool.release(obj);
+}
+
+void *expiring::operator new(size_t size)
+{
+    assert(size == sizeof(expiring));
+
+    return pool.alloc();
+}
+
+void expiring::operator delete(void *obj)
+{
+    assert(obj != NULL);
+
+    pool.release(obj);
 }
 
 registry::registry() :
@@ -139,9 +639,9 @@ const char *registry::getDomain(void)
 void registry::incUse(mapped *rr, stats::stat_t stat)
 {
     if(rr) {
-        Mutex::protect(rr);
+        mapped_modify(rr);
         ++rr->inuse;
-        Mutex::release(rr);
+        mapped_commit(rr);
         switch(rr->type) {
         case MappedRegistry::EXTERNAL:
             if(rr->source.external.statnode) {
@@ -167,9 +667,9 @@ void registry::incUse(mapped *rr, stats::stat_t stat)
 void registry::decUse(mapped *rr, stats::stat_t stat)
 {
     if(rr) {
-        Mutex::protect(rr);
+        mapped_modify(rr);
         --rr->inuse;
-        Mutex::release(rr);
+        mapped_commit(rr);
         switch(rr->type) {
         case MappedRegistry::EXTERNAL:
             if(rr->source.external.statnode) {
@@ -196,11 +696,8 @@ registry::mapped *registry::find(const char *id)
 {
     assert(id != NULL && *id != 0);
 
-    linked_pointer<mapped> rp;
-    unsigned path = NamedObject::keyindex(id, keysize);
-    if(!keys)
-        return NULL;
-    rp = keys[path];
+    linked_pointer<mapped> rp = keys(hashing(id));
+
     while(rp) {
         if(!strcmp(rp->userid, id))
             break;
@@ -209,6 +706,53 @@ registry::mapped *registry::find(const char *id)
     return *rp;
 }
 
+registry::mapped *registry::slot(void)
+{
+    mapped *rr = NULL;
+
+    indexing.modify();
+    if(freelist) {
+        rr = (mapped *)freelist;
+        freelist = rr->getNext();
+    }
+    else if(allocated_entries < mapped_entries)
+        rr = (mapped *)reg(allocated_entries++);
+    indexing.release();
+    return rr;
+}
+
+registry::mapped *registry::claim(const char *id)
+{
+    mapped *rr = slot();
+    stripelock *lock;
+
+    if(!rr)
+        return NULL;
+
+    // the free slot is unlisted, so nothing else can be waiting on it, but
+    // another thread may have listed the same id while we were locking it.
+
+    lock = stripe(rr);
+    lock->modify();
+    clear(rr);
+    mapped_modify(rr);
+    String::set(rr->userid, sizeof(rr->userid), id);
+    mapped_commit(rr);
+    indexing.modify();
+    if(find(id)) {
+        mapped_modify(rr);
+        rr->userid[0] = 0;
+        mapped_commit(rr);
+        rr->enlist(&freelist);
+        indexing.release();
+        lock->commit();
+        return NULL;
+    }
+    keys.enlist(rr, hashing(id));
+    indexing.release();
+    return rr;
+}
+
 unsigned registry::getIndex(mapped *rr)
 {
     assert((caddr_t)rr >= reg.addr());
@@ -227,13 +771,180 @@ void registry::start(service *cfg)
         shell::log(shell::FAIL, "registry could not be mapped");
     initialize();
     statmap = stats::create();
+    scheduled = new time_t[mapped_entries];
+    memset(scheduled, 0, sizeof(time_t) * mapped_entries);
+    time(&current);
+    saved = current;
+
+    // with periodic checkpoints the image is kept until the next one
+    // replaces it, so a crash right after startup loses nothing.  Without
+    // them it is consumed once read, so a later crash cannot replay
+    // contacts that were since removed.
+
+    checkpoint_t header;
+    struct stat ino;
+    fsys_t fs;
+
+    if(stat(CHECKPOINT_FILE, &ino))
+        return;
+
+    fs.open(CHECKPOINT_FILE, fsys::RDONLY);
+    if(is(fs) && fs.read(&header, sizeof(header)) == (ssize_t)sizeof(header)
+      && header.magic == CHECKPOINT_MAGIC && header.length == sizeof(lease_t)
+      && header.records && (off_t)(sizeof(header) + header.records * sizeof(lease_t)) == ino.st_size) {
+        leases = new lease_t[header.records];
+        while(checkpointed < header.records && fs.read(&leases[checkpointed], sizeof(lease_t)) == (ssize_t)sizeof(lease_t))
+            ++checkpointed;
+        shell::log(DEBUG1, "loaded %d registrations saved %ld seconds ago", checkpointed, (long)(current - header.saved));
+    }
+    else
+        shell::log(shell::WARN, "ignoring invalid registry checkpoint");
+    fs.close();
+    if(!saving)
+        fsys::erase(CHECKPOINT_FILE);
+}
+
+void registry::restore(void)
+{
+    voip::context_t context;
+    Socket::address via;
+    linked_pointer<target> tp;
+    lease_t *lp;
+    mapped *rr;
+    time_t now;
+    unsigned index = 0, restored = 0;
+
+    if(!leases)
+        return;
+
+    time(&now);
+    while(index < checkpointed) {
+        lp = &leases[index++];
+        if(lp->expires <= now)
+            continue;
+
+        rr = allocate(lp->userid);
+        if(!rr)
+            continue;
+
+        via.clear();
+        via.insert((struct sockaddr *)&lp->address);
+        context = stack::outbound(transport(lp->transport), (struct sockaddr *)&lp->address);
+        if(rr->type == MappedRegistry::USER)
+            rr->addTarget(via, lp->expires, lp->contact, lp->network, (struct sockaddr *)&lp->peering, context);
+        else
+            rr->setTarget(via, lp->expires, lp->contact, lp->network, (struct sockaddr *)&lp->peering, context);
+
+        stripe(rr)->exclusive();
+        tp = rr->source.internal.targets;
+        while(is(tp)) {
+            if(Socket::equal((struct sockaddr *)(&tp->address), (struct sockaddr *)(&lp->address))) {
+                tp->created = lp->created;
+                tp->status = lp->status;
+                tp->allows = lp->allows;
+                break;
+            }
+            tp.next();
+        }
+        if(!rr->created || lp->registered < rr->created)
+            rr->created = lp->registered;
+        stripe(rr)->share();
+        rr->update();
+        detach(rr);
+        ++restored;
+    }
+
+    delete[] leases;
+    leases = NULL;
+    checkpointed = 0;
+    if(restored)
+        shell::log(shell::NOTIFY, "restored %d registrations", restored);
+}
+
+void registry::checkpoint(void)
+{
+    checkpoint_t header;
+    lease_t lease;
+    linked_pointer<target> tp;
+    mapped *rr;
+    stripelock *lock;
+    fsys_t fs;
+    unsigned index = 0;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = CHECKPOINT_MAGIC;
+    header.length = sizeof(lease_t);
+    time(&header.saved);
+
+    fsys::erase(CHECKPOINT_FILE ".tmp");
+    fs.open(CHECKPOINT_FILE ".tmp", fsys::GROUP_PRIVATE, fsys::WRONLY);
+    if(!is(fs) || fs.write(&header, sizeof(header)) != (ssize_t)sizeof(header)) {
+        shell::log(shell::ERR, "cannot checkpoint registry");
+        return;
+    }
+
+    while(index < allocated_entries) {
+        rr = static_cast<mapped*>(reg(index++));
+        lock = stripe(rr);
+        lock->access();
+        switch(rr->type) {
+        case MappedRegistry::EXPIRED:
+        case MappedRegistry::TEMPORARY:
+        case MappedRegistry::EXTERNAL:
+            lock->release();
+            continue;
+        default:
+            break;
+        }
+        tp = rr->source.internal.targets;
+        while(is(tp)) {
+            if(tp->expires > header.saved) {
+                memset(&lease, 0, sizeof(lease));
+                String::set(lease.userid, sizeof(lease.userid), rr->userid);
+                lease.status = tp->status;
+                lease.transport = transport(tp->context);
+                lease.allows = tp->allows;
+                lease.registered = rr->created;
+                lease.created = tp->created;
+                lease.expires = tp->expires;
+                memcpy(&lease.address, &tp->address, sizeof(lease.address));
+                memcpy(&lease.peering, &tp->peering, sizeof(lease.peering));
+                String::set(lease.contact, sizeof(lease.contact), tp->contact);
+                String::set(lease.network, sizeof(lease.network), tp->network);
+                if(fs.write(&lease, sizeof(lease)) == (ssize_t)sizeof(lease))
+                    ++header.records;
+            }
+            tp.next();
+        }
+        lock->release();
+    }
+
+    fs.seek(0);
+    fs.write(&header, sizeof(header));
+    fs.close();
+
+    // an older image would replay contacts that have since gone away
+    if(!header.records) {
+        fsys::erase(CHECKPOINT_FILE ".tmp");
+        fsys::erase(CHECKPOINT_FILE);
+        return;
+    }
+
+    if(fsys::rename(CHECKPOINT_FILE ".tmp", CHECKPOINT_FILE))
+        shell::log(shell::ERR, "cannot save registry checkpoint");
+    else
+        shell::log(DEBUG1, "checkpointed %d registrations", header.records);
 }
 
 bool registry::check(void)
 {
     shell::log(shell::INFO, "checking registry...");
-    locking.modify();
-    locking.commit();
+    for(unsigned index = 0; index < stripes; ++index) {
+        striping[index].modify();
+        striping[index].commit();
+    }
+    indexing.modify();
+    indexing.release();
     return true;
 }
 
@@ -242,6 +953,7 @@ void registry::stop(service *cfg)
     assert(cfg != NULL);
 
     shell::log(DEBUG1, "stopping registry");
+    checkpoint();
     MappedMemory::release();
     MappedMemory::remove(control::env("regmap"));
     stats::release();
@@ -256,22 +968,34 @@ void registry::snapshot(FILE *fp)
     time_t now;
     linked_pointer<target> tp;
     linked_pointer<route> rp;
+    stripelock *lock;
     char buffer[128];
 
-    locking.access();
     fprintf(fp, "Registry:\n");
     fprintf(fp, "  mapped entries: %d\n", mapped_entries);
     fprintf(fp, "  active entries: %d\n", active_entries);
-    fprintf(fp, "  active routes:  %d\n", active_routes);
-    fprintf(fp, "  active targets: %d\n", active_targets);
+    fprintf(fp, "  active routes:  %d\n", route::pool.getLive());
+    fprintf(fp, "  active targets: %d\n", target::pool.getLive());
     fprintf(fp, "  published routes:  %d\n", published_routes);
-    fprintf(fp, "  allocated routes:  %d\n", allocated_routes);
-    fprintf(fp, "  allocated targets: %d\n", allocated_targets);
+    fprintf(fp, "  allocated routes:  %d\n", route::pool.getAllocated());
+    fprintf(fp, "  allocated targets: %d\n", target::pool.getAllocated());
     fprintf(fp, "  allocated entries: %d\n", allocated_entries);
+    fprintf(fp, "  lock stripes: %d\n", stripes);
+    fprintf(fp, "  active timers: %d\n", expiring::pool.getLive());
+    fprintf(fp, "  allocated timers: %d\n", expiring::pool.getAllocated());
+    indexing.access();
+    keys.snapshot(fp, "user");
+    contacts.snapshot(fp, "contact");
+    publishing.snapshot(fp, "publish");
+    addresses.snapshot(fp, "address");
+    fprintf(fp, "  route patterns: %d\n", routing->getCount());
+    indexing.release();
 
     while(regcount < mapped_entries) {
         time(&now);
         rr = static_cast<mapped*>(reg(regcount++));
+        lock = stripe(rr);
+        lock->access();
         if(rr->type == MappedRegistry::TEMPORARY) {
             fprintf(fp, "  temp %s; use=%d\n", rr->userid, rr->inuse);
         }
@@ -335,16 +1059,17 @@ void registry::snapshot(FILE *fp)
                 rp.next();
             }
         }
+        lock->release();
         fflush(fp);
         Thread::yield();
     }
-    locking.release();
 }
 
 void registry::clear(mapped *rr)
 {
     assert(rr != NULL);
 
+    mapped_modify(rr);
     rr->userid[0] = 0;
     rr->display[0] = 0;
     rr->remote[0] = 0;
@@ -360,6 +1085,7 @@ void registry::clear(mapped *rr)
     // this one is safe to clear...
     memset(&rr->profile, 0, sizeof(profile_t));
     rr->source.internal.published = rr->source.internal.targets = rr->source.internal.routes = NULL;
+    mapped_commit(rr);
 }
 
 bool registry::remove(const char *id)
@@ -368,41 +1094,56 @@ bool registry::remove(const char *id)
 
     bool rtn = true;
     mapped *rr, save;
+    stripelock *lock;
 
-    locking.modify();
+retry:
+    indexing.access();
     rr = find(id);
-    if(rr && rr->inuse)
+    indexing.release();
+    if(!rr)
+        return false;
+
+    lock = stripe(rr);
+    lock->modify();
+    if(!String::equal(rr->userid, id)) {
+        lock->commit();
+        goto retry;
+    }
+    if(rr->inuse)
         rtn = false;
-    else if(rr) {
+    else {
         store_unsafe<mapped>(save, rr);
-        expire(rr);
+        rtn = expire(rr);
     }
-    else
-        rtn = false;
-    locking.commit();
+    lock->commit();
     if(rtn)
         server::expire(&save);
     return rtn;
 }
 
-void registry::expire(mapped *rr)
+bool registry::expire(mapped *rr)
 {
     assert(rr != NULL);
 
     linked_pointer<target> tp = rr->source.internal.targets;
     linked_pointer<route> rp = rr->source.internal.routes;
-    unsigned path;
 
-    --active_entries;
+    // invite() pins entries under the index lock alone, so in use is only
+    // final once we hold it.
+    indexing.modify();
+    if(rr->inuse) {
+        indexing.release();
+        return false;
+    }
 
+    --active_entries;
+    unschedule(rr);
     while(rp) {
         route *nr = rp.getNext();
-        if(rr->type == MappedRegistry::SERVICE) {
-            path = NamedObject::keyindex(rp->entry.text, keysize);
-            rp->entry.delist(&contacts[path]);
-        }
+        if(rr->type == MappedRegistry::SERVICE)
+            contacts.delist(&rp->entry, hashing(rp->entry.text));
         else
-            rp->entry.delist(&primap[rp->entry.priority]);
+            routing->remove(rp->entry.text, &rp->entry);
         rp->entry.text[0] = 0;
         delete *rp;
         rp = nr;
@@ -411,8 +1152,7 @@ void registry::expire(mapped *rr)
     while(rp) {
         route *nr = rp.getNext();
         --published_routes;
-        path = NamedObject::keyindex(rp->entry.text, keysize);
-        rp->entry.delist(&publishing[path]);
+        publishing.delist(&rp->entry, hashing(rp->entry.text));
         rp->entry.text[0] = 0;
         delete *rp;
         rp = nr;
@@ -420,8 +1160,7 @@ void registry::expire(mapped *rr)
     while(tp) {
         // if active address index, delist & clear it
         if(tp->index.address) {
-            path = Socket::keyindex(tp->index.address, keysize);
-            tp->index.delist(&addresses[path]);
+            addresses.delist(&tp->index, hashing(tp->index.address));
             tp->index.address = NULL;
             tp->index.registry = NULL;
         }
@@ -429,6 +1168,7 @@ void registry::expire(mapped *rr)
         delete *tp;
         tp = nt;
     }
+    mapped_modify(rr);
     rr->source.internal.routes = NULL;
     rr->source.internal.targets = NULL;
     rr->source.internal.published = NULL;
@@ -438,46 +1178,78 @@ void registry::expire(mapped *rr)
     if(rr->ext && rr->ext >= reg.prefix && rr->ext < (reg.prefix + reg.range) && extmap[rr->ext - reg.prefix] == rr)
         extmap[rr->ext - reg.prefix] = NULL;
     shell::log(shell::INFO, "expiring %s; extension=%d", rr->userid, rr->ext);
-    path = NamedObject::keyindex(rr->userid, keysize);
+    keys.delist(rr, hashing(rr->userid));
     rr->display[0] = 0;
     rr->userid[0] = 0;
     rr->ext = 0;
     rr->status = MappedRegistry::OFFLINE;
     rr->type = MappedRegistry::EXPIRED;
     rr->rid = -1;
-    rr->delist(&keys[path]);
+    mapped_commit(rr);
     rr->enlist(&freelist);
+    indexing.release();
+    return true;
 }
 
 unsigned registry::cleanup(time_t period)
 {
     mapped *rr, save;
-    unsigned regcount = 0;
-    time_t now;
-    bool expired;
-    unsigned expcount = 0;
+    linked_pointer<expiring> tp;
+    time_t now, when;
+    bool expired, stale;
+    unsigned index, expcount = 0;
+    stripelock *lock;
+
+    time(&now);
+    tp = advance(now - period - 1);
+
+    while(is(tp)) {
+        expiring *next = static_cast<expiring *>(tp->getNext());
+        index = tp->index;
+        when = tp->when;
+        wheeling.acquire();
+        delete *tp;
+        wheeling.release();
+        tp = next;
 
-    while(regcount < mapped_entries) {
         expired = false;
-        time(&now);
-        rr = static_cast<mapped*>(reg(regcount++));
-        store_unsafe<mapped>(save, rr);
-        locking.modify();
-        if(rr->type != MappedRegistry::EXPIRED && rr->expires && rr->expires + period < now && !rr->inuse) {
-            expire(rr);
-            expired = true;
-        }
-        else if(!rr->inuse && rr->type == MappedRegistry::EXPIRED && rr->status != MappedRegistry::OFFLINE) {
-            expire(rr);
-            expired = true;
+        rr = static_cast<mapped*>(reg(index));
+        lock = stripe(rr);
+        lock->modify();
+
+        // a node is stale once its entry was rescheduled or released
+        wheeling.acquire();
+        stale = (scheduled[index] != when);
+        if(!stale)
+            scheduled[index] = 0;
+        wheeling.release();
+        if(stale) {
+            lock->commit();
+            continue;
         }
-        locking.commit();
-        Thread::yield();
+
+        store_unsafe<mapped>(save, rr);
+        if(rr->type != MappedRegistry::EXPIRED && rr->expires && rr->expires + period < now && !rr->inuse)
+            expired = expire(rr);
+        else if(!rr->inuse && rr->type == MappedRegistry::EXPIRED && rr->status != MappedRegistry::OFFLINE)
+            expired = expire(rr);
+
+        // an entry pinned by invite() since we looked is tried again later
+        if(!expired && rr->inuse && (rr->type == MappedRegistry::EXPIRED || (rr->expires && rr->expires + period < now)))
+            schedule(rr, now - period);
+        else if(!expired && rr->type != MappedRegistry::EXPIRED && rr->expires)
+            schedule(rr, rr->expires);
+        lock->commit();
         if(expired) {
             ++expcount;
             server::expire(&save);
         }
     }
+
+    if(saving && now >= saved + saving) {
+        saved = now;
+        checkpoint();
+    }
     return expcount;
 }
 
@@ -515,6 +1287,10 @@ void registry::reload(service *cfg)
                 expires = atoi(value);
             else if(!stricmp(key, "keysize") && !is_configured())
                 keysize = atoi(value);
+            else if(!stricmp(key, "stripes") && !is_configured())
+                stripes = atoi(value);
+            else if(!stricmp(key, "checkpoint"))
+                saving = atol(value);
         }
         sp.next();
     }
@@ -587,20 +1363,21 @@ void registry::reload(service *cfg)
     if(is_configured())
         return;
 
+    if(!stripes)
+        stripes = 1;
+    striping = new stripelock[stripes];
+    for(unsigned index = 0; index < stripes; ++index)
+        striping[index].slot = latency::REGISTRY_LOCK;
+
     if(range) {
         extmap = new mapped *[range];
         memset(extmap, 0, sizeof(mapped *) * range);
     }
-    primap = new LinkedObject *[routes];
-    memset(primap, 0, sizeof(LinkedObject *) * routes);
-    keys = new LinkedObject *[keysize];
-    contacts = new LinkedObject *[keysize];
-    publishing = new LinkedObject *[keysize];
-    addresses = new LinkedObject *[keysize];
-    memset(keys, 0, sizeof(LinkedObject *) * keysize);
-    memset(contacts, 0, sizeof(LinkedObject *) * keysize);
-    memset(publishing, 0, sizeof(LinkedObject *) * keysize);
-    memset(addresses, 0, sizeof(LinkedObject *) * keysize);
+    routing = new dialplan(keysize);
+    keys.create(keysize);
+    contacts.create(keysize);
+    publishing.create(keysize);
+    addresses.create(keysize);
 }
 
 unsigned registry::getEntries(void)
@@ -608,43 +1385,81 @@ unsigned registry::getEntries(void)
     return mapped_entries;
 }
 
+unsigned registry::loopback(unsigned entries, unsigned count)
+{
+    static unsigned configured = 0;
+    char id[MAX_USERID_SIZE];
+    mapped *rr;
+
+    if(!configured)
+        configured = stripes;
+
+    delete[] striping;
+    stripes = count ? count : configured;
+    striping = new stripelock[stripes];
+    for(unsigned index = 0; index < stripes; ++index)
+        striping[index].slot = latency::REGISTRY_LOCK;
+
+    if(allocated_entries)
+        return stripes;
+
+    mapped_entries = entries;
+    reg.create(control::env("regmap"), mapped_entries);
+    if(!reg)
+        shell::log(shell::FAIL, "registry could not be mapped");
+    reg.initialize();
+    statmap = stats::create();
+    scheduled = new time_t[mapped_entries];
+    memset(scheduled, 0, sizeof(time_t) * mapped_entries);
+    time(&current);
+    keys.create(keysize);
+    addresses.create(keysize);
+
+    for(unsigned index = 0; index < entries; ++index) {
+        snprintf(id, sizeof(id), "bench%u", index);
+        rr = claim(id);
+        if(!rr)
+            continue;
+        mapped_modify(rr);
+        rr->type = MappedRegistry::USER;
+        rr->status = MappedRegistry::IDLE;
+        mapped_commit(rr);
+        stripe(rr)->commit();
+    }
+    return stripes;
+}
+
+void registry::shutdown(void)
+{
+    reg.MappedMemory::release();
+    MappedMemory::remove(control::env("regmap"));
+    stats::release();
+}
+
 registry::mapped *registry::invite(const char *id, stats::stat_t stat)
 {
     assert(id != NULL && *id != 0);
 
     mapped *rr = NULL;
-    unsigned path = NamedObject::keyindex(id, keysize);
     service::usernode user;
     service::keynode *leaf = NULL;
     unsigned ext = 0;
 
-    locking.access();
+    // the caller usually holds the dialed entry already, so the entry is
+    // pinned under the index lock rather than its stripe; expire() will
+    // not release an entry that is in use once it holds the index.
+
+retry:
+    indexing.access();
     rr = find(id);
-    if(rr) {
+    if(rr)
         incUse(rr, stat);
-        locking.release();
+    indexing.release();
+    if(rr)
         return rr;
-    }
 
-    locking.exclusive();
-    if(freelist) {
-        rr = (mapped *)freelist;
-        freelist = rr->getNext();
-    }
-    else if(allocated_entries < mapped_entries)
-        rr = (mapped *)reg(allocated_entries++);
-    else {
-        locking.commit();
+    if(allocated_entries >= mapped_entries && !freelist)
         return NULL;
-    }
-
-    clear(rr);
-    rr->type = MappedRegistry::TEMPORARY;
-    rr->expires = 0;
-    rr->created = 0;
-    rr->display[0] = 0;
-    rr->inuse = 0;
-    rr->rid = -1;
 
     // in case inter-nodel temporary, create properties for call use...
 
@@ -654,24 +1469,46 @@ registry::mapped *registry::invite(const char *id, stats::stat_t stat)
         leaf = node->leaf("extension");
     if(leaf && leaf->getPointer())
         ext = atoi(leaf->getPointer());
-    if(ext && (ext < reg.prefix || ext >= (reg.prefix + reg.range))) {
-        rr->ext = ext;
-    }
-    else
+    if(ext >= reg.prefix && ext < (reg.prefix + reg.range))
         ext = 0;
-    leaf = node->leaf("display");
-    if(leaf && leaf->getPointer())
-        String::set(rr->display, sizeof(rr->display), leaf->getPointer());
 
-    server::release(user);
+    // a free slot is unlisted, so it is filled in before it can be found
+    // rather than under its stripe.
+
+    rr = slot();
+    if(!rr) {
+        server::release(user);
+        return NULL;
+    }
 
+    clear(rr);
+    mapped_modify(rr);
     String::set(rr->userid, sizeof(rr->userid), id);
+    if(node)
+        leaf = node->leaf("display");
+    else
+        leaf = NULL;
+    if(leaf && leaf->getPointer())
+        String::set(rr->display, sizeof(rr->display), leaf->getPointer());
     rr->ext = ext;
-    rr->enlist(&keys[path]);
+    rr->type = MappedRegistry::TEMPORARY;
     rr->status = MappedRegistry::OFFLINE;
-    incUse(rr, stat);
+    mapped_commit(rr);
+    server::release(user);
 
-    locking.commit();
+    indexing.modify();
+    if(find(id)) {
+        mapped_modify(rr);
+        rr->userid[0] = 0;
+        rr->type = MappedRegistry::EXPIRED;
+        mapped_commit(rr);
+        rr->enlist(&freelist);
+        indexing.release();
+        goto retry;
+    }
+    keys.enlist(rr, hashing(id));
+    incUse(rr, stat);
+    indexing.release();
     return rr;
 }
 
@@ -680,51 +1517,50 @@ registry::mapped *registry::allocate(const char *id)
     assert(id != NULL && *id != 0);
 
     mapped *rr = NULL, *prior;
-    unsigned path = NamedObject::keyindex(id, keysize);
     linked_pointer<service::keynode> rp;
     service::keynode *node, *leaf;
     unsigned ext = 0;
     const char *cp = "none";
     const char *cos = "none";
     profile_t *pro = NULL;
-    bool listed = false;
     service::usernode user;
+    stripelock *lock;
 
-    locking.modify();
+retry:
+    indexing.access();
     rr = find(id);
-    if(rr && rr->type != MappedRegistry::TEMPORARY && rr->type != MappedRegistry::EXPIRED) {
-        locking.share();
-        return rr;
+    indexing.release();
+    if(rr) {
+        lock = stripe(rr);
+        lock->modify();
+        if(!String::equal(rr->userid, id)) {
+            lock->commit();
+            goto retry;
+        }
+        if(rr->type != MappedRegistry::TEMPORARY && rr->type != MappedRegistry::EXPIRED) {
+            lock->share();
+            return hold(rr);
+        }
     }
-
-    if(rr)
-        listed = true;
     else {
-        if(freelist) {
-            rr = (mapped *)freelist;
-            freelist = rr->getNext();
-        } else if(allocated_entries < mapped_entries)
-            rr = (mapped *)reg(allocated_entries++);
-        if(rr)
-            clear(rr);
-    }
-    if(!rr) {
-        locking.commit();
-        return NULL;
+        if(allocated_entries >= mapped_entries && !freelist)
+            return NULL;
+        rr = claim(id);
+        if(!rr)
+            goto retry;
+        lock = stripe(rr);
     }
 
     server::getProvision(id, user);
     node = user.keys;
     cp = "none";
+    mapped_modify(rr);
     rr->rid = -1;
     rr->type = MappedRegistry::EXPIRED;
     rr->expires = 0;
     rr->created = 0;
     rr->display[0] = 0;
 
-    if(!listed)
-        rr->inuse = 0;
-
     if(node)
         cp = node->getId();
 
@@ -739,17 +1575,24 @@ registry::mapped *registry::allocate(const char *id)
         rr->type = MappedRegistry::GATEWAY;
     else if(!stricmp(cp, "service") || !stricmp(cp, "device"))
         rr->type = MappedRegistry::SERVICE;
+    mapped_commit(rr);
     if(!node || rr->type == MappedRegistry::EXPIRED) {
         server::release(user);
-        if(listed && rr->inuse)
+        indexing.modify();
+        if(rr->inuse) {
+            mapped_modify(rr);
             rr->type = MappedRegistry::TEMPORARY;
-        else if(listed) {
-            rr->delist(&keys[path]);
-            listed = false;
+            mapped_commit(rr);
         }
-        if(!listed)
+        else {
+            keys.delist(rr, hashing(id));
+            mapped_modify(rr);
+            rr->userid[0] = 0;
+            mapped_commit(rr);
             rr->enlist(&freelist);
-        locking.commit();
+        }
+        indexing.release();
+        lock->commit();
         return NULL;
     }
 
@@ -785,8 +1628,11 @@ registry::mapped *registry::allocate(const char *id)
     }
 
     rp = node->leaf("display");
-    if(is(rp) && rp->getPointer())
+    if(is(rp) && rp->getPointer()) {
+        mapped_modify(rr);
         String::set(rr->display, sizeof(rr->display), rp->getPointer());
+        mapped_commit(rr);
+    }
 
     // we add routes while still exclusive owner of registry since
     // they update priority indexes.
@@ -833,37 +1679,51 @@ registry::mapped *registry::allocate(const char *id)
             pro = server::getProfile(cos);
         if(!pro)
             pro = server::getProfile("*");
+        mapped_modify(rr);
         if(pro)
             memcpy(&rr->profile, pro, sizeof(rr->profile));
+        mapped_commit(rr);
     }
 
     server::release(user);
-    rr->ext = 0;
+    mapped_modify(rr);
     rr->status = MappedRegistry::IDLE;
+    mapped_commit(rr);
 
-    if(!listed) {
-        String::set(rr->userid, sizeof(rr->userid), id);
-        rr->enlist(&keys[path]);
-    }
+    // extensions only change owner under the index lock, and an entry that
+    // gives one up also gives up its extmap slot.  The prior owner is under
+    // another stripe, but the record lock of mapped_modify serializes the
+    // write, and lookups by extension confirm the owner under their stripe.
 
-    if(ext >= reg.prefix && ext < (reg.prefix + reg.range)) {
+    indexing.modify();
+    if(ext < reg.prefix || ext >= (reg.prefix + reg.range))
+        ext = 0;
+    if(rr->ext != ext && rr->ext >= reg.prefix && rr->ext < (reg.prefix + reg.range) && extmap[rr->ext - reg.prefix] == rr)
+        extmap[rr->ext - reg.prefix] = NULL;
+    if(ext) {
         prior = extmap[ext - reg.prefix];
         if(prior && prior != rr) {
             shell::log(shell::INFO, "releasing %s from extension %d", prior->userid, ext);
-            prior->ext = 0;
+            mapped_modify(prior);
+            if(prior->ext == ext)
+                prior->ext = 0;
+            mapped_commit(prior);
         }
         extmap[ext - reg.prefix] = rr;
-        rr->ext = ext;
         shell::log(shell::INFO, "activating %s; extension=%d", rr->userid, ext);
     }
+    mapped_modify(rr);
+    rr->ext = ext;
+    mapped_commit(rr);
     ++active_entries;
+    indexing.release();
 
-    // exchange exclusive mutex lock for registry to shared before return
-    // when registry state is again stable.
+    // exchange exclusive lock for the entry stripe to shared before return
+    // when the entry state is again stable.
 
-    locking.share();
+    lock->share();
 
-    return rr;
+    return hold(rr);
 }
 
 registry::mapped *registry::address(const struct sockaddr *addr)
@@ -872,14 +1732,18 @@ registry::mapped *registry::address(const struct sockaddr *addr)
 
     target *target;
     linked_pointer<target::indexing> ind;
-    mapped *rr = NULL;
-    unsigned path = Socket::keyindex(addr, keysize);
+    linked_pointer<registry::target> tp;
+    mapped *rr;
+    unsigned path = hashing(addr);
+    stripelock *lock;
     time_t now;
 
-    locking.access();
+retry:
+    rr = NULL;
+    indexing.access();
 
     time(&now);
-    ind = addresses[path];
+    ind = addresses(path);
 
     while(ind) {
         target = ind->getTarget();
@@ -889,10 +1753,24 @@ registry::mapped *registry::address(const struct sockaddr *addr)
         }
         ind.next();
     }
+    indexing.release();
 
     if(!rr)
-        locking.release();
-    return rr;
+        return NULL;
+
+    // targets only change under the entry stripe, so confirm it still
+    // holds the address now that we own a share of it.
+
+    lock = stripe(rr);
+    take(lock);
+    tp = rr->source.internal.targets;
+    while(is(tp)) {
+        if(tp->expires > now && Socket::equal(addr, (struct sockaddr *)(&tp->address)))
+            return hold(rr);
+        tp.next();
+    }
+    lock->release();
+    goto retry;
 }
 
 registry::mapped *registry::contact(const char *uri)
@@ -936,9 +1814,12 @@ registry::mapped *registry::contact(const struct sockaddr *addr, const char *uid
 
     mapped *rr;
     linked_pointer<route> rp;
-    unsigned path = NamedObject::keyindex(uid, keysize);
-    locking.access();
-    rp = contacts[path];
+    unsigned path = hashing(uid);
+    stripelock *lock;
+
+retry:
+    indexing.access();
+    rp = contacts(path);
     while(rp) {
         if(!stricmp(uid, rp->entry.text) && Socket::equal(addr, (struct sockaddr *)(&rp->entry.registry->contact)))
             break;
@@ -946,11 +1827,24 @@ registry::mapped *registry::contact(const struct sockaddr *addr, const char *uid
     }
 
     if(!rp) {
-        locking.release();
+        indexing.release();
         return NULL;
     }
     rr = rp->entry.registry;
-    return rr;
+    indexing.release();
+
+    lock = stripe(rr);
+    take(lock);
+    if(rr->type == MappedRegistry::SERVICE && Socket::equal(addr, (struct sockaddr *)(&rr->contact))) {
+        rp = rr->source.internal.routes;
+        while(is(rp)) {
+            if(!stricmp(uid, rp->entry.text))
+                return hold(rr);
+            rp.next();
+        }
+    }
+    lock->release();
+    goto retry;
 }
 
 bool registry::isUserid(const char *id)
@@ -994,24 +1888,42 @@ registry::pattern *registry::getRouting(unsigned trs, const char *id)
 {
     assert(id != NULL && *id != 0);
 
-    linked_pointer<pattern> pp;
+    linked_pointer<route> rp;
+    pattern *found;
+    mapped *rr;
+    stripelock *lock;
+
     if(trs > reg.routes)
         trs = reg.routes;
 
     if(!trs)
         return NULL;
 
-    locking.access();
-    while(trs--) {
-        pp = primap[trs];
-        while(pp) {
-            if(service::match(id, pp->text, false) && pp->registry)
-                return *pp;
-            pp.next();
+retry:
+    indexing.access();
+    found = static_cast<pattern *>(routing->find(id, trs));
+    if(!found || !found->registry) {
+        indexing.release();
+        return NULL;
+    }
+    rr = found->registry;
+    indexing.release();
+
+    // route entries are recycled, so make sure the pattern still belongs
+    // to the registry we locked before handing it back.
+
+    lock = stripe(rr);
+    take(lock);
+    rp = rr->source.internal.routes;
+    while(is(rp)) {
+        if(&rp->entry == found && found->registry == rr) {
+            hold(rr);
+            return found;
         }
+        rp.next();
     }
-    locking.release();
-    return NULL;
+    lock->release();
+    goto retry;
 }
 
 registry::mapped *registry::getExtension(const char *id)
@@ -1020,16 +1932,30 @@ registry::mapped *registry::getExtension(const char *id)
 
     unsigned ext = atoi(id);
     registry::mapped *rr = NULL;
+    stripelock *lock;
     time_t now;
 
-    locking.access();
-    time(&now);
+    indexing.access();
     rr = extmap[ext - reg.prefix];
-    if(rr->expires && rr->expires < now)
-        rr = NULL;
+    indexing.release();
     if(!rr)
-        locking.release();
-    return rr;
+        return NULL;
+
+    // the extension moved on while we waited; its slot is cleared or
+    // taken over by then, so there is nothing to retry for.
+
+    lock = stripe(rr);
+    take(lock);
+    if(rr->ext != ext) {
+        lock->release();
+        return NULL;
+    }
+    time(&now);
+    if(rr->expires && rr->expires < now) {
+        lock->release();
+        return NULL;
+    }
+    return hold(rr);
 }
 
 bool registry::exists(const char *id)
@@ -1058,11 +1984,15 @@ registry::mapped *registry::dialing(const char *id)
 
     mapped *rr;
     unsigned ext = 0;
+    stripelock *lock;
+    bool byext;
 
     if(isExtension(id))
         ext = atoi(id);
 
-    locking.access();
+retry:
+    byext = false;
+    indexing.access();
     rr = find(id);
 
     // if extension dialing, and we find by id but have ext #, then ignore
@@ -1070,11 +2000,26 @@ registry::mapped *registry::dialing(const char *id)
         rr = NULL;
 
     // assuming not user id exclusive dialing, then we can try ext...
-    if(!rr && service::dialmode != service::USER_DIALING && reg.range && ext >= reg.prefix && ext < (reg.prefix + reg.range))
+    if(!rr && service::dialmode != service::USER_DIALING && reg.range && ext >= reg.prefix && ext < (reg.prefix + reg.range)) {
         rr = extmap[ext - reg.prefix];
+        byext = true;
+    }
+    indexing.release();
     if(!rr)
-        locking.release();
-    return rr;
+        return NULL;
+
+    // an entry found by id that was released is unlisted, so look again;
+    // one found by extension that lost it is not coming back.
+
+    lock = stripe(rr);
+    take(lock);
+    if(!matching(rr, id, ext)) {
+        lock->release();
+        if(byext)
+            return NULL;
+        goto retry;
+    }
+    return hold(rr);
 }
 
 
@@ -1084,17 +2029,33 @@ registry::mapped *registry::access(const char *id)
 
     mapped *rr;
     unsigned ext = 0;
+    stripelock *lock;
+    bool byext;
 
     if(isExtension(id))
         ext = atoi(id);
 
-    locking.access();
+retry:
+    byext = false;
+    indexing.access();
     rr = find(id);
-    if(!rr && reg.range && ext >= reg.prefix && ext < (reg.prefix + reg.range))
+    if(!rr && reg.range && ext >= reg.prefix && ext < (reg.prefix + reg.range)) {
         rr = extmap[ext - reg.prefix];
+        byext = true;
+    }
+    indexing.release();
     if(!rr)
-        locking.release();
-    return rr;
+        return NULL;
+
+    lock = stripe(rr);
+    take(lock);
+    if(!matching(rr, id, ext)) {
+        lock->release();
+        if(byext)
+            return NULL;
+        goto retry;
+    }
+    return hold(rr);
 }
 
 void registry::detach(mapped *rr)
@@ -1107,7 +2068,8 @@ void registry::detach(mapped *rr)
     if(!rr || rr->type == MappedRegistry::EXTERNAL)
         return;
 
-    locking.release();
+    unhold(rr);
+    stripe(rr)->release();
 }
 
 unsigned registry::mapped::setTarget(Socket::address& target_addr, time_t lease, const char *target_contact, const char *target_network, struct sockaddr *target_peering, voip::context_t context)
@@ -1126,11 +2088,11 @@ unsigned registry::mapped::setTarget(Socket::address& target_addr, time_t lease,
         return 0;
 
     if(!context)
-        context = stack::sip.out_context;
+        context = stack::outbound(stack::sip.out_context, ai);
 
     len = Socket::len(ai);
 
-    locking.exclusive();
+    stripe(this)->exclusive();
     tp = source.internal.targets;
     while(is(tp) && count > 1) {
         delete *tp;
@@ -1149,11 +2111,14 @@ unsigned registry::mapped::setTarget(Socket::address& target_addr, time_t lease,
         creating = true;
     }
     expires = tp->expires = lease;
+    schedule(this, lease);
     if(!Socket::equal((struct sockaddr *)(&tp->address), ai)) {
         if(tp->index.address) {
-            tp->index.delist(&addresses[Socket::keyindex(tp->index.address, keysize)]);
+            indexing.modify();
+            addresses.delist(&tp->index, hashing(tp->index.address));
             tp->index.address = NULL;
             tp->index.registry = NULL;
+            indexing.release();
             creating = true;
         }
 
@@ -1163,11 +2128,15 @@ unsigned registry::mapped::setTarget(Socket::address& target_addr, time_t lease,
         if(!oi)
             oi = ai;
         memcpy(&tp->address, ai, len);
+        mapped_modify(this);
         memcpy(&contact, oi, len);
+        mapped_commit(this);
         if(creating) {
             tp->index.registry = this;
             tp->index.address = (struct sockaddr *)(&tp->address);
-            tp->index.enlist(&addresses[Socket::keyindex(tp->index.address, keysize)]);
+            indexing.modify();
+            addresses.enlist(&tp->index, hashing(tp->index.address));
+            indexing.release();
         }
         if(origin)
             delete origin;
@@ -1176,9 +2145,11 @@ unsigned registry::mapped::setTarget(Socket::address& target_addr, time_t lease,
     Socket::store(&tp->peering, target_peering);
     String::set(tp->network, sizeof(tp->network), target_network);
     String::set(tp->contact, sizeof(tp->contact), target_contact);
+    mapped_modify(this);
     String::set(network, sizeof(network), target_network);
     uri::userid(target_contact, remote, sizeof(remote));
-    locking.share();
+    mapped_commit(this);
+    stripe(this)->share();
     return 1;
 }
 
@@ -1186,7 +2157,7 @@ void registry::mapped::addRoute(const char *route_pattern, unsigned route_priori
 {
     assert(route_pattern != NULL && *route_pattern != 0);
 
-    locking.exclusive();
+    stripe(this)->exclusive();
     route *rp = new route;
 
     if(!route_prefix)
@@ -1199,41 +2170,47 @@ void registry::mapped::addRoute(const char *route_pattern, unsigned route_priori
     String::set(rp->entry.suffix, MAX_USERID_SIZE, route_suffix);
     rp->entry.priority = route_priority;
     rp->entry.registry = this;
-    rp->entry.enlist(&primap[route_priority]);
+    indexing.modify();
+    routing->add(rp->entry.text, &rp->entry, route_priority, ++sequence);
+    indexing.release();
     rp->enlist(&source.internal.routes);
-    locking.share();
+    stripe(this)->share();
 }
 
 void registry::mapped::addPublished(const char *published_id)
 {
     assert(published_id != NULL && *published_id != 0);
 
-    unsigned path = NamedObject::keyindex(published_id, keysize);
-    locking.exclusive();
+    unsigned path = hashing(published_id);
+    stripe(this)->exclusive();
     route *rp = new route;
     String::set(rp->entry.text, MAX_USERID_SIZE, published_id);
     rp->entry.priority = 0;
     rp->entry.registry = this;
-    rp->entry.enlist(&publishing[path]);
+    indexing.modify();
+    publishing.enlist(&rp->entry, path);
+    indexing.release();
     rp->enlist(&source.internal.published);
     ++published_routes;
-    locking.share();
+    stripe(this)->share();
 }
 
 void registry::mapped::addContact(const char *contact_id)
 {
     assert(contact_id != NULL && *contact_id != 0);
 
-    unsigned path = NamedObject::keyindex(contact_id, keysize);
+    unsigned path = hashing(contact_id);
 
-    locking.exclusive();
+    stripe(this)->exclusive();
     route *rp = new route;
     String::set(rp->entry.text, MAX_USERID_SIZE, contact_id);
     rp->entry.priority = 0;
     rp->entry.registry = this;
-    rp->entry.enlist(&contacts[path]);
+    indexing.modify();
+    contacts.enlist(&rp->entry, path);
+    indexing.release();
     rp->enlist(&source.internal.routes);
-    locking.share();
+    stripe(this)->share();
 }
 
 void registry::mapped::update(void)
@@ -1316,11 +2293,12 @@ bool registry::mapped::expire(Socket::address& saddr)
     }
     if(!active_count) {
         registry::mapped save;
-        Mutex::protect(this);
+        mapped_modify(this);
         store_unsafe<registry::mapped>(save, this);
         type = MappedRegistry::EXPIRED;
         expires = 0;
-        Mutex::release(this);
+        mapped_commit(this);
+        schedule(this, 0);
         server::expire(&save);
         return true;
     }
@@ -1372,10 +2350,11 @@ bool registry::mapped::refresh(Socket::address& saddr, time_t lease, const char
             uri::userid(target_contact, target_userid, sizeof(target_userid));
             uri::userid(tp->contact, contact_userid, sizeof(contact_userid));
             if(String::equal(target_userid, contact_userid)) {
-                Mutex::protect(this);
+                mapped_modify(this);
                 if(lease > expires)
                     expires = lease;
-                Mutex::release(this);
+                mapped_commit(this);
+                schedule(this, expires);
                 tp->expires = lease;
                 return true;
             }
@@ -1403,12 +2382,13 @@ unsigned registry::mapped::addTarget(Socket::address& target_addr, time_t lease,
         return 0;
 
     if(!context)
-        context = stack::sip.out_context;
+        context = stack::outbound(stack::sip.out_context, ai);
 
-    locking.exclusive();
+    stripe(this)->exclusive();
     tp = source.internal.targets;
     if(lease > expires)
         expires = lease;
+    schedule(this, expires);
 
     len = Socket::len(ai);
     time(&now);
@@ -1422,9 +2402,11 @@ unsigned registry::mapped::addTarget(Socket::address& target_addr, time_t lease,
     if(tp) {
         if(expired && expired != *tp) {
             if(expired->index.address) {
-                expired->index.delist(&addresses[Socket::keyindex(expired->index.address, keysize)]);
+                indexing.modify();
+                addresses.delist(&expired->index, hashing(expired->index.address));
                 expired->index.address = NULL;
                 expired->index.registry = NULL;
+                indexing.release();
             }
             expired->delist(&source.internal.targets);
             --count;
@@ -1437,7 +2419,7 @@ unsigned registry::mapped::addTarget(Socket::address& target_addr, time_t lease,
         Socket::store(&tp->peering, target_peering);
         String::set(tp->contact, sizeof(tp->contact), target_contact);
         String::set(tp->network, sizeof(tp->network), target_network);
-        locking.share();
+        stripe(this)->share();
         return count;
     }
     if(!expired) {
@@ -1451,9 +2433,11 @@ unsigned registry::mapped::addTarget(Socket::address& target_addr, time_t lease,
         expired->context = context;
         expired->enlist(&source.internal.targets);
         expired->status = registry::target::READY;
+        mapped_modify(this);
         memcpy(&contact, oi, len);
         String::set(network, sizeof(network), target_network);
         uri::userid(target_contact, remote, sizeof(remote));
+        mapped_commit(this);
         if(origin)
             delete origin;
         ++count;
@@ -1465,10 +2449,12 @@ unsigned registry::mapped::addTarget(Socket::address& target_addr, time_t lease,
     Socket::store(&expired->peering, target_peering);
     String::set(expired->contact, sizeof(expired->contact), target_contact);
     String::set(expired->network, sizeof(expired->network), target_network);
+    indexing.modify();
     expired->index.registry = this;
     expired->index.address = (struct sockaddr *)(&expired->address);
-    expired->index.enlist(&addresses[Socket::keyindex(expired->index.address, keysize)]);
-    locking.share();
+    addresses.enlist(&expired->index, hashing(expired->index.address));
+    indexing.release();
+    stripe(this)->share();
     update();
     return count;
 }
@@ -1486,9 +2472,9 @@ unsigned registry::mapped::setTargets(Socket::address& target_addr, voip::contex
     if(!al)
         return 0;
 
-    locking.exclusive();
+    stripe(this)->exclusive();
     if(expires) {
-        locking.share();
+        stripe(this)->share();
         return 0;
     }
 
@@ -1506,7 +2492,7 @@ unsigned registry::mapped::setTargets(Socket::address& target_addr, voip::contex
         len = Socket::len(al->ai_addr);
 
         tp = new target;
-        tp->context = context;
+        tp->context = stack::outbound(context, al->ai_addr);
         time(&tp->created);
         subnet = server::getPolicy(al->ai_addr);
         if(subnet) {
@@ -1518,21 +2504,22 @@ unsigned registry::mapped::setTargets(Socket::address& target_addr, voip::contex
             String::set(tp->network, sizeof(tp->network), "*");
         }
         server::release(subnet);
-        String::set(network, sizeof(network), tp->network);
         memcpy(&tp->address, al->ai_addr, len);
+        mapped_modify(this);
+        String::set(network, sizeof(network), tp->network);
         memcpy(&contact, &tp->address, len);
         remote[0] = 0;
+        mapped_commit(this);
         stack::sipAddress(&tp->address, tp->contact, userid);
 
         tp->expires = 0l;
-        tp->context = context;
         tp->status = registry::target::READY;
         tp->enlist(&source.internal.targets);
         ++count;
         al = al->ai_next;
     }
     expires = 0;
-    locking.share();
+    stripe(this)->share();
     update();
     return count;
 }
@@ -39,7 +39,6 @@
 
 namespace sipwitch {
 
-static mempager mempool(PAGING_SIZE);
 static bool running = true;
 
 static bool activating(int argc, char **args, voip::context_t context)
@@ -84,6 +83,7 @@ service(id, PAGING_SIZE)
 
     memset(keys, 0, sizeof(keys));
     acl = NULL;
+    routing = NULL;
 }
 
 const char *server::referRemote(MappedRegistry *rr, const char *target, char *buffer, size_t size)
@@ -227,7 +227,7 @@ void server::confirm(void)
     dir_t dir;
     keynode *access = getPath("access");
     char *id = NULL, *secret = NULL;
-    const char *ext;
+    const char *ext, *text;
     linked_pointer<service::keynode> node;
     service::keynode *leaf;
     FILE *fp;
@@ -247,6 +247,30 @@ void server::confirm(void)
     // add any missing keys
     getPath("devices");
 
+    // index static routing; earlier entries rank higher so the plan gives
+    // the same first match as walking the list.  It lives in this config,
+    // so it is swapped in and released along with it.
+
+    node = getList("routing");
+    number = 0;
+    while(is(node)) {
+        ++number;
+        node.next();
+    }
+    mp = alloc(sizeof(dialplan));
+    routing = new(mp) dialplan(number, this);
+    node = getList("routing");
+    while(is(node)) {
+        text = getValue(*node, "pattern");
+        if(text)
+            routing->add(text, *node, 0, number);
+        text = getValue(*node, "identity");
+        if(text && *text)
+            routing->identity(text, *node, 0, number);
+        --number;
+        node.next();
+    }
+
     // construct default profiles
 
     provision = getPath("provision");
@@ -766,8 +790,8 @@ service::keynode *server::getRouting(const char *id)
     assert(id != NULL && *id != 0);
     assert(cfg != NULL);
 
-    linked_pointer<keynode> node;
-    const char *cp;
+    keynode *node = NULL;
+    server *cfgp;
 
     // never re-route in-dialing nodes...
 
@@ -777,18 +801,13 @@ service::keynode *server::getRouting(const char *id)
     if(!cfg)
         return NULL;
 
+    // patterns and fixed identities are indexed when the config commits
     locking.access();
-    node = cfg->getList("routing");
-    while(is(node)) {
-        cp = getValue(*node, "pattern");
-        if(cp && match(id, cp, false))
-            return *node;
-        // we can use fixed identities instead of patterns...
-        cp = getValue(*node, "identity");
-        if(cp && !stricmp(cp, id))
-            return *node;
-        node.next();
-    }
+    cfgp = static_cast<server*>(cfg);
+    if(cfgp->routing)
+        node = (keynode *)cfgp->routing->find(id, 1);
+    if(node)
+        return node;
     locking.release();
     return NULL;
 }
@@ -894,7 +913,7 @@ void server::dump(FILE *fp)
     assert(cfg != NULL);
 
     fprintf(fp, "Server:\n");
-    fprintf(fp, "  allocated pages: %d\n", server::allocate());
+    fprintf(fp, "  allocated pages: %d\n", slab::pages());
     fprintf(fp, "  configure pages: %d\n", cfg->pages());
     fprintf(fp, "  memory paging:   %ld\n", (long)PAGING_SIZE);
     keynode *reg = getPath("registry");
@@ -907,6 +926,7 @@ void server::dump(FILE *fp)
         fprintf(fp, "  sip stack keys:\n");
         service::dump(fp, reg->getFirst(), 4);
     }
+    slab::snapshot(fp);
 }
 
 void server::reload(void)
@@ -1020,28 +1040,9 @@ void server::reload(void)
         shell::log(shell::FAIL, "no configuration");
         exit(2);
     }
-}
 
-unsigned server::allocate(void)
-{
-    return mempool.pages();
-}
-
-void *server::allocate(size_t size, LinkedObject **list, volatile unsigned *count)
-{
-    assert(size > 0);
-    void *mp;
-    if(list && *list) {
-        mp = *list;
-        *list = (*list)->getNext();
-    }
-    else {
-        if(count)
-            ++(*count);
-        mp = mempool.alloc(size);
-    }
-    memset(mp, 0, size);
-    return mp;
+    // subnets may have changed, so must any cached media paths
+    media::invalidate();
 }
 
 #ifdef _MSWINDOWS_
@@ -1116,6 +1117,8 @@ void server::run(void)
     while(running && NULL != (cp = control::receive())) {
         shell::debug(9, "received request %s\n", cp);
 
+        // lock waits sampled by the last command
+        latency::flush();
         logtime.set();
 
         if(eq(cp, "reload")) {
@@ -1165,18 +1168,8 @@ void server::run(void)
             FILE *out = control::output(NULL);
             if(!out)
                 continue;
-            FILE *log = fopen(control::env("siplogs"), "r");
-            if(!log) {
-                fclose(out);
-                continue;
-            }
-
-            while(fgets(buf, sizeof(buf), log) != NULL) {
-                cp = String::strip(buf, " \t\r\n");
-                fprintf(out, "%s\n", cp);
-            }
+            trace::dump(out);
             fclose(out);
-            fclose(log);
             continue;
         }
 
@@ -61,6 +61,185 @@ public:
     static void load(void);
 };
 
+class __LOCAL slab
+{
+private:
+    class __LOCAL node
+    {
+    public:
+        node *next;
+    };
+
+    slab *link;
+    const char *name;
+    size_t size;
+    unsigned index;
+    unsigned batch;
+    unsigned limit;
+    mutex_t lock;
+    node *depot;
+    unsigned depoted;
+    volatile unsigned live;
+    volatile unsigned peak;
+    volatile unsigned allocated;
+
+    static slab *list;
+    static unsigned count;
+
+    void refill(void);
+    void drain(unsigned keep);
+
+public:
+    slab(const char *id, size_t objsize, unsigned transfer = 32, unsigned reserve = 256);
+
+    void *alloc(void);
+    void release(void *obj);
+
+    inline unsigned getLive(void) const
+        {return live;}
+
+    inline unsigned getPeak(void) const
+        {return peak;}
+
+    inline unsigned getAllocated(void) const
+        {return allocated;}
+
+    static void retire(void);
+    static unsigned pages(void);
+    static void snapshot(FILE *fp);
+};
+
+class __LOCAL trace : private DetachedThread
+{
+private:
+    static trace *writer;
+
+    trace();
+
+    void run(void);
+
+public:
+    static void start(void);
+    static void stop(void);
+    static void post(voip::msg_t msg, bool inbound);
+    static void clear(void);
+    static void dump(FILE *out);
+    static void snapshot(FILE *fp);
+};
+
+class __LOCAL latency
+{
+public:
+    enum {QUEUE = 0, REGISTRY_LOCK, STACK_LOCK};
+
+    static void start(void);
+    static void stop(void);
+    static uint64_t now(void);
+    static unsigned event(int type);
+    static void record(unsigned slot, uint64_t started);
+
+    // stripe lock waits are sampled and kept per thread until merged
+    static uint64_t sample(void);
+    static void waited(unsigned slot, uint64_t started);
+    static void flush(void);
+};
+
+// media relay and registry benchmarks, run in place of the server by
+// sipw --benchmark and sipw --contention
+class __LOCAL bench : private JoinableThread
+{
+private:
+    typedef enum {SEND, RECEIVE, SIGNAL} kind_t;
+
+    unsigned index;
+    kind_t kind;
+    uint64_t cpu;
+    unsigned long max, ops;
+    unsigned long buckets[LATENCY_BUCKETS];
+
+    bench(unsigned id, kind_t type);
+
+    void run(void);
+    void send(void);
+    void receive(void);
+    void signalling(void);
+
+    static bool contend(unsigned entries, unsigned seconds, unsigned threads, unsigned stripes);
+
+public:
+    static int measure(unsigned streams, unsigned seconds, unsigned threads);
+    static int contention(unsigned entries, unsigned seconds, unsigned threads);
+};
+
+// a stripe lock that records how long it waited to be acquired, for a
+// sample of acquisitions
+class __LOCAL stripelock : public ConditionalLock
+{
+public:
+    unsigned slot;
+
+    inline void access(void)
+        {uint64_t t = latency::sample(); ConditionalLock::access(); if(t) latency::waited(slot, t);}
+
+    inline void modify(void)
+        {uint64_t t = latency::sample(); ConditionalLock::modify(); if(t) latency::waited(slot, t);}
+
+    inline void exclusive(void)
+        {uint64_t t = latency::sample(); ConditionalLock::exclusive(); if(t) latency::waited(slot, t);}
+};
+
+class __LOCAL dialplan
+{
+public:
+    class __LOCAL rule : public LinkedObject
+    {
+    public:
+        const char *text;
+        void *object;
+        unsigned priority;
+        unsigned long order;
+        bool exact;
+    };
+
+private:
+    class __LOCAL node
+    {
+    public:
+        node *child[17];
+        LinkedObject *rules;
+    };
+
+    memalloc *pager;
+    node *root;
+    LinkedObject *fallback;
+    LinkedObject **texts;
+    unsigned keysize;
+    unsigned count;
+
+    void *alloc(size_t size);
+    void free(void *mem);
+    rule *create(const char *text, void *object, unsigned priority, unsigned long order, bool exact);
+    bool remove(node *np, const char *cp, const char *text, void *object);
+    void purge(node *np);
+    void search(node *np, const char *digits, unsigned limit, rule **best) const;
+
+    static int select(char code);
+    static void rank(rule *rp, unsigned limit, rule **best);
+    void unlist(LinkedObject **root, const char *text, void *object);
+
+public:
+    dialplan(unsigned size, memalloc *mem = NULL);
+    ~dialplan();
+
+    void add(const char *pattern, void *object, unsigned priority, unsigned long order);
+    void identity(const char *id, void *object, unsigned priority, unsigned long order);
+    void remove(const char *pattern, void *object);
+    void *find(const char *id, unsigned limit) const;
+
+    inline unsigned getCount(void) const
+        {return count;}
+};
+
 class __LOCAL registry : private service::callback, private mapped_array<MappedRegistry>
 {
 public:
@@ -130,6 +309,7 @@ public:
 
         static void *operator new(size_t size);
         static void operator delete(void *ptr);
+        static slab pool;
     };
 
     class __LOCAL pattern : public LinkedObject
@@ -150,6 +330,7 @@ private:
 
         static void *operator new(size_t size);
         static void operator delete(void *ptr);
+        static slab pool;
     };
 
     bool check(void);
@@ -159,8 +340,11 @@ private:
     void snapshot(FILE *fp);
 
     static void clear(mapped *rr);
-    static void expire(mapped *rr);
+    static bool expire(mapped *rr);
     static mapped *find(const char *id);
+    static mapped *slot(void);
+    static mapped *claim(const char *id);
+    static void checkpoint(void);
 
     static registry reg;
 
@@ -213,6 +397,12 @@ public:
     static void detach(mapped *m);
     static bool remove(const char *id);
     static unsigned cleanup(time_t period);
+    static void restore(void);
+
+    // map synthetic user entries without a server, for the contention
+    // benchmark; returns the stripe count in use (0 for the default).
+    static unsigned loopback(unsigned entries, unsigned stripes);
+    static void shutdown(void);
 };
 
 class __LOCAL stack : public service::callback, private mapped_array<MappedCall>, public OrderedIndex
@@ -262,19 +452,22 @@ private:
 
         enum {OPEN, CLOSED, RING, BUSY, REORDER, REFER, REINVITE} state;
 
-        char sdp[MAX_SDP_BUFFER];       // sdp body to use in exchange
-        char identity[MAX_URI_SIZE];    // our effective contact/to point...
-        char sysident[MAX_IDENT_SIZE];  // ident of this session
-        char display[MAX_DISPLAY_SIZE]; // callerid reference field
+        // strings are kept in the string arena of the parent call, except
+        // sdp, which has a buffer of its own reused by each exchange
+        const char *sdp;                // sdp body to use in exchange
+        char *sdpbuf;
+        size_t sdpsize;
+        const char *identity;           // our effective contact/to point...
+        const char *sysident;           // ident of this session
+        const char *display;            // callerid reference field
+        const char *from;               // formatted from line for endpoint
         char network[MAX_NETWORK_SIZE]; // network policy affinity for nat
-        char from[MAX_URI_SIZE + MAX_DISPLAY_SIZE]; // formatted from line for endpoint
         char uuid[48];
 
         LinkedObject *nat;              // media nat chain...
+        cdr::media_t sent, received;    // of proxies released on re-invite
         struct sockaddr_storage peering;
 
-        char authid[MAX_USERID_SIZE];   // for authentication...
-        char secret[MAX_USERID_SIZE];
         enum {NONE, DIGEST} authtype;
 
         inline bool isSource(void) const
@@ -291,6 +484,7 @@ private:
 
         static void *operator new(size_t size);
         static void operator delete(void *obj);
+        static slab pool;
 
         session sid;
 
@@ -308,15 +502,20 @@ private:
         destination_t type;
 
         call();
+        ~call();
 
-        Timer timer;
+        uint64_t deadline;      // when an armed timer expires
+        unsigned slot;          // timer heap position + 1, or 0
         state_t state;
-        char forward[MAX_USERID_SIZE];  // ref id for forwarding...
-        char divert[MAX_USERID_SIZE];   // used in forward management
-        char dialed[MAX_IDENT_SIZE];    // user or ip address...
-        char subject[MAX_URI_SIZE];     // call subject
-        char request[MAX_URI_SIZE];     // requesting identity for refer flip
-
+        const char *forward;    // ref id for forwarding...
+        const char *divert;     // used in forward management
+        const char *dialed;     // user or ip address...
+        const char *subject;    // call subject
+        const char *request;    // requesting identity for refer flip
+
+        char *dup(const char *text);
+        const char *setSDP(session *s, const char *text);
+        char *format(const char *fmt, ...) __PRINTF(2, 3);
         void disarm(void);
         void arm(timeout_t timeout);
         void reply_source(int error);
@@ -357,9 +556,17 @@ private:
         time_t expires, starting, ending;
         int experror;           // error at expiration...
         bool phone;
+        bool released;          // waiting to be reaped
+
+        // string arena; all freed together with the call
+        void *strings;
+        char *strfree;
+        size_t stravail;
+        mutex_t strlock;
 
         static void *operator new(size_t size);
         static void operator delete(void *obj);
+        static slab pool;
 
     private:
         void expired(void);
@@ -372,6 +579,15 @@ private:
     bool check(void);
 
     static void divert(stack::call *cr, voip::msg_t msg);
+    static void reap(call *cr);
+    static unsigned inactive(void);
+    static void unlist(session *s);
+    static stripelock *stripe(call *cr);
+    static bool schedule(call *cr, timeout_t timeout);
+    static void unschedule(call *cr);
+    static timeout_t remaining(call *cr);
+    static call *due(timeout_t *next);
+    static void sift(unsigned index);
 
     unsigned threading, priority;
     size_t stacksize;
@@ -420,11 +636,8 @@ public:
         inline bool operator!()
             {return !active;}
 
-        inline void up(void)
-            {active = true;}
-
-        inline void down(void)
-            {active = false;}
+        void up(void);
+        void down(void);
 
         inline bool offline(void)
             {return active == false;}
@@ -443,11 +656,14 @@ public:
     static void clear(session *s);
     static void close(session *s);
     static session *access(voip::call_t cid);
+    static bool isDatagram(voip::context_t context);
+    static unsigned overloaded(timeout_t delay);
+    static uint64_t ticks(void);
     static char *sipAddress(struct sockaddr_internet *addr, char *buf, const char *user = NULL, size_t size = MAX_URI_SIZE);
     static char *sipPublish(struct sockaddr_internet *addr, char *buf, const char *user = NULL, size_t size = MAX_URI_SIZE);
     static char *sipContact(struct sockaddr_internet *addr, char *buf, const char *user = NULL, const char *display = NULL, size_t size = MAX_URI_SIZE);
     static Socket::address *getAddress(const char *uri, Socket::address *addr = NULL);
-    static void siplog(voip::msg_t msg);
+    static void siplog(voip::msg_t msg, bool inbound = false);
     static void enableDumping(void);
     static void clearDumping(void);
     static void disableDumping(void);
@@ -483,6 +699,7 @@ private:
     keynode **extmap;
     keynode *provision;
     LinkedObject *profiles;
+    dialplan *routing;
 
     bool create(const char *id, keynode *node);
     keynode *find(const char *id);
@@ -517,8 +734,6 @@ public:
     static void plugins(const char *argv0, const char *names);
     static void run(void);
     static void stop(void);
-    static void *allocate(size_t size, LinkedObject **list, volatile unsigned *count = NULL);
-    static unsigned allocate(void);
 
     static bool announce(MappedRegistry *rr, const char *msgtype, const char *event, const char *expires, const char *body);
     static void activate(MappedRegistry *rr);
@@ -568,13 +783,22 @@ public:
 };
 
 
-class __LOCAL thread : private DetachedThread
+class __LOCAL thread : private DetachedThread, private Conditional
 {
 private:
     friend class stack;
     friend class stack::call;
+    friend class latency;
 
     const char *instance;
+    thread **workers;       // receiving thread dispatches to these
+    unsigned pool;
+    unsigned running;       // workers of the pool not yet stopped
+    thread *receiver;       // receiving thread when a worker of a pool
+    voip::event_t *events;  // queue when a worker of a pool
+    uint64_t *posted;       // when each queued event was posted (nsec)
+    unsigned head, tail, pending;
+    timeout_t delay;        // queue delay of the current event
     unsigned extension;
     stack::subnet *access;
     char network[MAX_NETWORK_SIZE];
@@ -618,8 +842,12 @@ private:
 
     static void wait(unsigned count);
     static const char *eid(eXosip_event_type ev);
+    static unsigned create(voip::context_t ctx, const char *tag, unsigned count, int priority);
 
-    void send_reply(int error);
+    void post(voip::event_t ev);
+    voip::event_t fetch(timeout_t timeout);
+
+    void send_reply(int error, unsigned retry = 0);
     void expiration(void);
     void invite(void);
     void identify(void);
@@ -658,24 +886,42 @@ public:
 
         static void shutdown(void);
 
+        // pick the thread a newly activated proxy belongs to
+        static thread *assign(void);
+
+        mutex_t shard;      // held while this thread copies its proxies
+        int epfd, wakeup[2];    // per thread epoll set and its wakeup pipe
+
     private:
-        thread();
+        unsigned index;
+        int cpu;
+
+        thread(unsigned id);
+        ~thread();
 
         void run(void);
     };
 
-    // a support class to help in sdp parsing
+    class proxy;
+
+    // single pass sdp rewriter; copies the source sdp into the target
+    // buffer, giving each media stream an even/odd pair of proxies for rtp
+    // and rtcp (the odd one unused with rtcp-mux) and rewriting c=, m= and
+    // a=rtcp lines to match.
     class __LOCAL sdp
     {
     public:
         const char *bufdata;
         char *outdata, *result;
-        size_t buflen, outpos;
+        size_t outsize, outpos;
         struct sockaddr *peering;
         struct sockaddr_storage local, top;
         LinkedObject **nat;
-        unsigned mediacount;
+        proxy *rtp;
+        bool mux, rtcp;
         unsigned short mediaport;
+        char address[64];
+        const char *family;
 
         sdp();
         sdp(const char *source, char *target, size_t len = MAX_SDP_BUFFER);
@@ -684,15 +930,20 @@ public:
             {return (struct sockaddr *)&local;}
 
         void set(const char *source, char *target, size_t len = MAX_SDP_BUFFER);
-        char *get(char *buffer, size_t len);
-        size_t put(char *buffer);
 
-        // check connect in sdp output
-        void check_connect(char *buffer, size_t len);
-        void check_media(char *buffer, size_t len);
+        // rewrite the whole sdp, returns result or NULL on failure
+        char *rewrite(void);
 
-        // can do backfill of NAT if connect in media record
-        void reconnect(void);
+    private:
+        void put(const char *text, size_t len);
+        void put(const char *text);
+        proxy *attach(unsigned short port);
+        proxy *control(unsigned short port);
+
+        void connect(const char *line, size_t len);
+        void open(const char *line, size_t len);
+        void attribute(const char *line, size_t len);
+        void close(void);
     };
 
     // proxy socket class
@@ -702,19 +953,40 @@ public:
         void release(void);
 
     public:
+        // relay statistics for one direction, from rtp headers only
+        class __LOCAL stream
+        {
+        public:
+            unsigned long packets, bytes, lost;
+            unsigned long errors;   // dropped as truncated, or not sent
+            unsigned long jitter;   // rfc 3550 estimate, usec * 16
+            int64_t transit;
+            uint16_t sequence;
+            bool started;
+            time_t last;
+
+            void update(const uint8_t *header, size_t len, uint64_t usec, time_t now);
+        };
+
+        thread *owner;
         socket_t so;
         time_t expires;
         uint16_t port;
         struct sockaddr_storage local, remote, peering;
         bool fw;    // to be used when we add ipfw rules support
 
+        // packets sent by the local (sdp) endpoint, and relayed to it
+        stream sent, received;
+        time_t activated;
+
         proxy();
         ~proxy();
 
         bool activate(media::sdp *parser);
-        void release(time_t expire = 0l);
+        void reset(void);
+        void close(void);
         void reconnect(struct sockaddr *address);
-        void copy(void);
+        bool copy(void);
     };
 
     media();
@@ -726,20 +998,43 @@ public:
     // get and activate nat instance if any are free...
     static proxy *get(media::sdp *parser);
 
+    // activate the rtcp proxy paired with an rtp proxy from get()
+    static proxy *pair(media::sdp *parser, proxy *rtp);
+
     // set ipv6 flag, removes need to proxy any external addresses...
     static void enableIPV6(void);
 
     // release any existing media proxy for the call session, proxy can be kept active for re-invite transition
     static void release(LinkedObject **nat, unsigned expires = 0);
 
+    // return proxies whose re-invite transition time has expired
+    static void cleanup(void);
+
+    // forget cached proxy decisions when subnets change
+    static void invalidate(void);
+
+    // start or stop the relay without a server, for the benchmark
+    static void loopback(unsigned ports, unsigned threads);
+    static void shutdown(void);
+
+    // true if no proxy of the session has relayed media within the
+    // configured media timeout; always false if there is none
+    static bool isIdle(LinkedObject *nat);
+
+    // add relay statistics of a session's proxies to cdr media totals
+    static void collect(LinkedObject *nat, cdr::media_t *sent, cdr::media_t *received);
+
+    // as above, including proxies the session released on re-invite
+    static void collect(stack::session *session, cdr::media_t *sent, cdr::media_t *received);
+
     // rewrite an invite for a call target if different, otherwise uses original source sdp...
     static char *invite(stack::session *session, const char *target, LinkedObject **nat, char *sdp, size_t size = MAX_SDP_BUFFER);
 
     // rewrite or copy sdp of session on answer for connection
-    static char *answer(stack::session *session, const char *sdp);
+    static const char *answer(stack::session *session, const char *sdp);
 
     // re-assign or copy sdp on re-invite; clears and rebuilds media proxy if needed...
-    static char *reinvite(stack::session *session, const char *sdp);
+    static const char *reinvite(stack::session *session, const char *sdp);
 
 private:
     // low level rewrite & proxy assignment
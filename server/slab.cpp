@@ -0,0 +1,267 @@
+// Copyright (C) 2006-2014 David Sugar, Tycho Softworks.
+// Copyright (C) 2015 Cherokees of Idaho.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "server.h"
+
+namespace sipwitch {
+
+// Each object type has its own slab.  A thread keeps a small magazine of
+// free objects per slab, so most allocations and releases touch no lock at
+// all.  Magazines exchange objects with the shared depot of the slab a
+// batch at a time, and a depot holding more than its reserve hands the
+// excess back to the heap rather than keeping every object ever made.
+// When a thread that used a magazine exits, its magazines are returned to
+// the depots; on windows they are not, and stay bounded by two batches
+// per slab.
+
+#define SLAB_TYPES  8
+
+#if defined(_MSC_VER)
+#define SLAB_LOCAL  __declspec(thread)
+#else
+#define SLAB_LOCAL  __thread
+#endif
+
+#if defined(__GNUC__)
+#define SLAB_INC(x) __sync_add_and_fetch(&(x), 1)
+#define SLAB_DEC(x) __sync_sub_and_fetch(&(x), 1)
+#define SLAB_CAS(x, o, n) __sync_bool_compare_and_swap(&(x), o, n)
+#else
+#define SLAB_INC(x) (++(x))
+#define SLAB_DEC(x) (--(x))
+#define SLAB_CAS(x, o, n) ((x) = (n), true)
+#endif
+
+typedef struct {
+    void *list;
+    unsigned count;
+} magazine_t;
+
+static SLAB_LOCAL magazine_t magazines[SLAB_TYPES];
+
+#ifndef _MSWINDOWS_
+static pthread_key_t exiting;
+static pthread_once_t keyed = PTHREAD_ONCE_INIT;
+static SLAB_LOCAL bool attached = false;
+
+static void retiring(void *arg)
+{
+    slab::retire();
+}
+
+static void keying(void)
+{
+    pthread_key_create(&exiting, &retiring);
+}
+
+// the key only exists to run retiring() when a thread using magazines exits
+static void attach(void)
+{
+    pthread_once(&keyed, &keying);
+    pthread_setspecific(exiting, &attached);
+    attached = true;
+}
+#endif
+
+slab *slab::list = NULL;
+unsigned slab::count = 0;
+
+slab::slab(const char *id, size_t objsize, unsigned transfer, unsigned reserve)
+{
+    assert(id != NULL && objsize > 0 && transfer > 0);
+
+    if(objsize < sizeof(node))
+        objsize = sizeof(node);
+
+    name = id;
+    size = objsize;
+    batch = transfer;
+    limit = reserve;
+    depot = NULL;
+    depoted = 0;
+    live = peak = allocated = 0;
+    index = count++;
+    link = list;
+    list = this;
+}
+
+void slab::refill(void)
+{
+    magazine_t *mag = &magazines[index];
+    node *np;
+
+    lock.acquire();
+    while(depot && mag->count < batch) {
+        np = depot;
+        depot = np->next;
+        --depoted;
+        np->next = (node *)mag->list;
+        mag->list = np;
+        ++mag->count;
+    }
+    lock.release();
+}
+
+void slab::drain(unsigned keep)
+{
+    magazine_t *mag = &magazines[index];
+    node *np, *excess = NULL;
+
+    lock.acquire();
+    while(mag->list && mag->count > keep) {
+        np = (node *)mag->list;
+        mag->list = np->next;
+        --mag->count;
+        np->next = depot;
+        depot = np;
+        ++depoted;
+    }
+    while(depoted > limit) {
+        np = depot;
+        depot = np->next;
+        --depoted;
+        np->next = excess;
+        excess = np;
+    }
+    lock.release();
+
+    while(excess) {
+        np = excess;
+        excess = np->next;
+        ::free(np);
+        SLAB_DEC(allocated);
+    }
+}
+
+void *slab::alloc(void)
+{
+    node *np = NULL;
+    unsigned total, high;
+
+    if(index < SLAB_TYPES) {
+        magazine_t *mag = &magazines[index];
+#ifndef _MSWINDOWS_
+        if(!attached)
+            attach();
+#endif
+        if(!mag->list)
+            refill();
+        np = (node *)mag->list;
+        if(np) {
+            mag->list = np->next;
+            --mag->count;
+        }
+    }
+    else {
+        lock.acquire();
+        np = depot;
+        if(np) {
+            depot = np->next;
+            --depoted;
+        }
+        lock.release();
+    }
+
+    if(!np) {
+        np = (node *)::malloc(size);
+        if(!np)
+            shell::log(shell::FAIL, "no memory for %s", name);
+        SLAB_INC(allocated);
+    }
+
+    total = SLAB_INC(live);
+    for(;;) {
+        high = peak;
+        if(total <= high || SLAB_CAS(peak, high, total))
+            break;
+    }
+
+    memset(np, 0, size);
+    return np;
+}
+
+void slab::release(void *obj)
+{
+    assert(obj != NULL);
+
+    node *np = (node *)obj;
+
+    SLAB_DEC(live);
+    if(index < SLAB_TYPES) {
+        magazine_t *mag = &magazines[index];
+#ifndef _MSWINDOWS_
+        if(!attached)
+            attach();
+#endif
+        np->next = (node *)mag->list;
+        mag->list = np;
+        if(++mag->count >= batch * 2)
+            drain(batch);
+        return;
+    }
+
+    lock.acquire();
+    if(depoted < limit) {
+        np->next = depot;
+        depot = np;
+        ++depoted;
+        np = NULL;
+    }
+    lock.release();
+    if(np) {
+        ::free(np);
+        SLAB_DEC(allocated);
+    }
+}
+
+void slab::retire(void)
+{
+    slab *sp = list;
+
+    while(sp) {
+        if(sp->index < SLAB_TYPES)
+            sp->drain(0);
+        sp = sp->link;
+    }
+}
+
+unsigned slab::pages(void)
+{
+    slab *sp = list;
+    size_t total = 0;
+
+    while(sp) {
+        total += sp->allocated * sp->size;
+        sp = sp->link;
+    }
+    return (unsigned)((total + PAGING_SIZE - 1) / PAGING_SIZE);
+}
+
+void slab::snapshot(FILE *fp)
+{
+    assert(fp != NULL);
+
+    slab *sp = list;
+
+    fprintf(fp, "Slabs:\n");
+    while(sp) {
+        fprintf(fp, "  %s: live %d, peak %d, allocated %d, depot %d\n",
+            sp->name, sp->live, sp->peak, sp->allocated, sp->depoted);
+        sp = sp->link;
+    }
+}
+
+} // end namespace
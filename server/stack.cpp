@@ -18,21 +18,84 @@
 
 namespace sipwitch {
 
-static volatile unsigned allocated_segments = 0;
-static volatile unsigned active_segments = 0;
-static volatile unsigned allocated_calls = 0;
+#define OVERLOAD_WEIGHT 8       // each event moves the average delay 1/8
+
+#if defined(__GNUC__)
+#define STACK_CAS(x, o, n)  __sync_bool_compare_and_swap(&(x), o, n)
+#define STACK_INC(x)        __sync_add_and_fetch(&(x), 1)
+#else
+#define STACK_CAS(x, o, n)  ((x) == (o) ? ((x) = (n), true) : false)
+#define STACK_INC(x)        (++(x))
+#endif
+
 static volatile unsigned allocated_maps = 0;
-static volatile unsigned active_calls = 0;
 static unsigned mapped_calls = 0;
-static LinkedObject *freesegs = NULL;
-static LinkedObject *freecalls = NULL;
 static LinkedObject *freemaps = NULL;
 static LinkedObject **hash = NULL;
+static rwlock_t *indexing = NULL;
 static unsigned keysize = 177;
+static unsigned stripes = 64;
+static stripelock *striping = NULL;
 static condlock_t locking;
 static mutex_t mapping;
+static LinkedObject **heap = NULL;
+static unsigned heaped = 0;
+static unsigned heapsize = 0;
+static mutex_t scheduling;
+static unsigned shards = 1;
+static timeout_t overload_delay = 0;
+static unsigned overload_calls = 0;
+static unsigned retry_after = 5;
+static volatile unsigned overload_active = 0;
+static volatile unsigned long overload_rejects = 0;
+static volatile timeout_t overload_average = 0;
+
+// Sessions are found by call id through a hash with one lock per bucket.
+// A thread working on a session holds the stripe lock of its call shared,
+// and changes to the segments of a call (or its release) take that stripe
+// exclusively, so only events for the same call (or calls sharing a
+// stripe) wait on each other.  The global lock now only covers the list
+// of calls, and released calls are freed by the background thread once no
+// thread still holds them.
+
+// With shards set above one, several udp contexts bind the sip port with
+// SO_REUSEPORT, each with its own event threads, and each peer address is
+// steered to one of them (voip::shard).  Registrations and sessions keep
+// the context a request arrived on, and requests we originate toward a
+// resolved peer (providers, unregistered targets, restored registrations)
+// are sent from the shard that peer is steered to, so they leave from the
+// sip port and their replies and in-dialog requests come back to the
+// shard that sent them.  The usual udp context binds an unshared
+// ephemeral port only for requests whose peer is not known beforehand.
+
+// New calls and out of dialog requests are refused with a 503 while the
+// event queue delay or the number of active calls is above its limit, so
+// calls already in progress keep their share of the server.  Once over, a
+// limit must fall to three quarters before requests are admitted again.
+// The queue delay is a moving average over recent events, so one slow
+// event does not flip the server into overload.  Only contexts with
+// worker threads (threading 2 or more) queue events, so with a single
+// thread the delay is always zero and only the calls limit applies.
+
+// Armed call timers are kept in a binary min heap by deadline, and each
+// call remembers its heap slot, so arming or disarming is O(log n) and the
+// background thread only visits calls that are due.  Released calls are
+// queued on the heap with an immediate deadline to be reaped.
+
+uint64_t stack::ticks(void)
+{
+#ifdef  _MSWINDOWS_
+    return (uint64_t)GetTickCount64();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000l + (uint64_t)(now.tv_nsec / 1000000l);
+#endif
+}
 
 stack::background *stack::background::thread = NULL;
+slab stack::segment::pool("sessions", sizeof(stack::segment));
+slab stack::call::pool("calls", sizeof(stack::call));
 
 static bool tobool(const char *s)
 {
@@ -131,6 +194,18 @@ cidr(acl, ifaddr(addr, id), id)
     }
 }
 
+void stack::subnet::up(void)
+{
+    active = true;
+    media::invalidate();
+}
+
+void stack::subnet::down(void)
+{
+    active = false;
+    media::invalidate();
+}
+
 stack::segment::segment(voip::context_t context, call *cr, int cid, int did, int tid) : OrderedObject()
 {
     assert(cr != NULL);
@@ -145,17 +220,23 @@ stack::segment::segment(voip::context_t context, call *cr, int cid, int did, int
     time(&now);
     enlist(&(cr->segments));
     sid.context = context;
+    indexing[cid % keysize].modify();
     sid.enlist(&hash[cid % keysize]);
+    indexing[cid % keysize].release();
     sid.sequence = (uint32_t)now;
     sid.sequence &= 0xffffffffl;
     sid.expires = 0l;
     sid.nat = NULL;
+    memset(&sid.sent, 0, sizeof(sid.sent));
+    memset(&sid.received, 0, sizeof(sid.received));
     sid.cid = cid;
     sid.did = did;
     sid.tid = tid;
     sid.parent = cr;
     sid.state = session::OPEN;
-    sid.sdp[0] = 0;
+    sid.sdp = sid.identity = sid.sysident = sid.display = sid.from = "";
+    sid.sdpbuf = NULL;
+    sid.sdpsize = 0;
     sid.reg = NULL;
     sid.closed = false;
 
@@ -166,30 +247,28 @@ void *stack::segment::operator new(size_t size)
 {
     assert(size == sizeof(stack::segment));
 
-    return server::allocate(size, &freesegs, &allocated_segments);
+    return pool.alloc();
 }
 
 void stack::segment::operator delete(void *obj)
 {
     assert(obj != NULL);
 
-    ((LinkedObject*)(obj))->enlist(&freesegs);
+    pool.release(obj);
 }
 
 void *stack::call::operator new(size_t size)
 {
     assert(size == sizeof(stack::call));
 
-    ++active_calls;
-    return server::allocate(size, &freecalls, &allocated_calls);
+    return pool.alloc();
 }
 
 void stack::call::operator delete(void *obj)
 {
     assert(obj != NULL);
 
-    ((LinkedObject*)(obj))->enlist(&freecalls);
-    --active_calls;
+    pool.release(obj);
 }
 
 stack::background::background(timeout_t iv) : DetachedThread(), Conditional(), expires(Timer::inf)
@@ -227,7 +306,8 @@ void stack::background::run(void)
     timeout_t timeout, current;
     Timer expiration = interval;
     time_t then = 0, now;
-    stack::call *next;
+    stack::call *cr;
+    stripelock *lock;
     time_t period = 10;
 
     time(&then);
@@ -253,16 +333,20 @@ void stack::background::run(void)
             // release lock in case expire calls update timer methods...
             Conditional::unlock();
             timeout = interval;
-            locking.access();
-            linked_pointer<stack::call> cp = stack::sip.begin();
-            while(cp) {
-                next = (stack::call *)cp->getNext();
-                current = cp->getTimeout();
-                if(current && current < timeout)
-                    timeout = current;
-                cp = next;
+            while((cr = stack::due(&current)) != NULL) {
+                if(cr->released) {
+                    locking.modify();
+                    stack::reap(cr);
+                    locking.commit();
+                    continue;
+                }
+                lock = stack::stripe(cr);
+                lock->access();
+                cr->getTimeout();
+                lock->release();
             }
-            locking.release();
+            if(current && current < timeout)
+                timeout = current;
             expiration = timeout;
         }
         else {
@@ -278,8 +362,13 @@ void stack::background::run(void)
                 shell::debug(9, "registry cleanup; %d expired", released);
             else
                 shell::debug(9, "registry cleanup; no entries expired");
+            media::cleanup();
+            released = stack::inactive();
+            if(released)
+                shell::debug(9, "media inactivity; %d calls disconnected", released);
         }
         messages::automatic();
+        latency::flush();
     }
 }
 
@@ -318,8 +407,7 @@ void stack::disableDumping(void)
 
 void stack::clearDumping(void)
 {
-    ::remove(DEFAULT_VARPATH "/log/sipdump.log");
-    ::remove(_STR(control::path("controls") + "/sipdump.log"));
+    trace::clear();
 }
 
 void stack::enableDumping(void)
@@ -328,27 +416,12 @@ void stack::enableDumping(void)
     stack::sip.dumping = true;
 }
 
-void stack::siplog(voip::msg_t msg)
+void stack::siplog(voip::msg_t msg, bool inbound)
 {
-    fsys_t log;
-    char *text = NULL;
-    size_t tlen;
-
     if(!msg || !stack::sip.dumping)
         return;
 
-    osip_message_to_str(msg, &text, &tlen);
-    if(text) {
-        log.open(control::env("siplogs"), fsys::GROUP_PRIVATE, fsys::APPEND);
-        if(is(log)) {
-            Mutex::protect(&stack::sip.dumping);
-            log.write(text, tlen);
-            log.write("---\n\n", 5);
-            Mutex::release(&stack::sip.dumping);
-            log.close();
-        }
-        osip_free(text);
-    }
+    trace::post(msg, inbound);
 }
 
 void stack::close(session *s)
@@ -412,17 +485,17 @@ void stack::clear(session *s)
 
     if(s->cid > 0) {
         Mutex::release(cr);
-        locking.exclusive();
+        stripe(cr)->exclusive();
         shell::debug(4, "clearing call %08x:%u session %08x:%u\n",
             cr->source->sequence, cr->source->cid, s->sequence, s->cid);
         if(s->state != session::CLOSED) {
             s->state = session::CLOSED;
             voip::release_call(s->context, s->cid, s->did);
         }
-        s->delist(&hash[s->cid % keysize]);
+        unlist(s);
         s->cid = 0;
         s->did = -1;
-        locking.share();
+        stripe(cr)->share();
     }
     else
         Mutex::release(cr);
@@ -558,17 +631,17 @@ void stack::destroy(call *cr)
     MappedCall *map;
 
     linked_pointer<segment> sp;
+    stripelock *lock = stripe(cr);
 
     cdr *clog = cr->log();
 
-    // we assume access lock was already held when we call this...
+    // we assume the call stripe was already held when we call this.  The
+    // segments stay allocated until the background thread reaps the call,
+    // since other threads may still be returning from them.
 
-    locking.exclusive();
+    lock->exclusive();
     sp = cr->segments.begin();
     while(sp) {
-        --active_segments;
-        segment *next = sp.getNext();
-
         if(!sp->sid.closed) {
             if(&(sp->sid) == cr->source)
                 registry::decUse(sp->sid.reg, stats::INCOMING);
@@ -581,27 +654,232 @@ void stack::destroy(call *cr)
             if(sp->sid.state != session::CLOSED) {
                 voip::release_call(sp->sid.context, sp->sid.cid, sp->sid.did);
             }
-            sp->sid.delist(&hash[sp->sid.cid % keysize]);
+            unlist(&sp->sid);
         }
         if(sp->sid.nat)
             media::release(&sp->sid.nat);
-        delete *sp;
-        sp = next;
+        sp.next();
     }
     map = cr->map;
-    cr->delist();
-    delete cr;
-    locking.share();
+    cr->map = NULL;
+    cr->released = true;
+    if(schedule(cr, 0))
+        background::notify();
+    lock->share();
     release(map);
     if(clog)
         cdr::post(clog);
 }
 
+void stack::reap(call *cr)
+{
+    assert(cr != NULL);
+
+    linked_pointer<segment> sp = cr->segments.begin();
+    stripelock *lock = stripe(cr);
+
+    // a released call cannot be found again, so once any thread still
+    // holding its stripe lets go it is safe to free.
+
+    unschedule(cr);
+    lock->modify();
+    lock->commit();
+    while(sp) {
+        segment *next = sp.getNext();
+        delete *sp;
+        sp = next;
+    }
+    cr->delist();
+    delete cr;
+}
+
+// Joined calls whose proxied media has stopped in both directions are
+// assumed to have lost their endpoints, and are disconnected; this sends a
+// bye on both legs, and the proxies are returned when the call is reaped.
+
+unsigned stack::inactive(void)
+{
+    linked_pointer<call> cp;
+    unsigned count = 0;
+    stripelock *lock;
+    call *cr;
+
+    // each call is tested and terminated under its stripe, as the timer
+    // path does, so it cannot be destroyed by another thread meanwhile.
+
+    locking.access();
+    cp = stack::sip.begin();
+    while(is(cp)) {
+        cr = *cp;
+        cp.next();
+        lock = stripe(cr);
+        lock->access();
+        Mutex::protect(cr);
+        if(cr->state == call::JOINED && cr->target && !cr->released &&
+          (cr->source->nat || cr->target->nat) &&
+          (!cr->source->nat || media::isIdle(cr->source->nat)) &&
+          (!cr->target->nat || media::isIdle(cr->target->nat))) {
+            shell::log(shell::INFO, "call %08x:%u media inactive",
+                cr->source->sequence, cr->source->cid);
+            cr->terminateLocked();
+            cr->reason = "inactive";
+            ++count;
+        }
+        Mutex::release(cr);
+        lock->release();
+    }
+    locking.release();
+    return count;
+}
+
+bool stack::schedule(call *cr, timeout_t timeout)
+{
+    assert(cr != NULL);
+
+    unsigned index;
+    bool head;
+
+    scheduling.acquire();
+    cr->deadline = ticks() + timeout;
+    if(cr->slot)
+        index = cr->slot - 1;
+    else {
+        if(heaped >= heapsize) {
+            unsigned size = heapsize ? heapsize * 2 : 64;
+            LinkedObject **list = new LinkedObject *[size];
+            if(heaped)
+                memcpy(list, heap, sizeof(LinkedObject *) * heaped);
+            delete[] heap;
+            heap = list;
+            heapsize = size;
+        }
+        index = heaped++;
+        heap[index] = cr;
+        cr->slot = index + 1;
+    }
+    sift(index);
+    head = (heap[0] == cr);
+    scheduling.release();
+    return head;
+}
+
+void stack::unschedule(call *cr)
+{
+    assert(cr != NULL);
+
+    unsigned index;
+
+    scheduling.acquire();
+    if(cr->slot) {
+        index = cr->slot - 1;
+        cr->slot = 0;
+        if(index < --heaped) {
+            heap[index] = heap[heaped];
+            sift(index);
+        }
+    }
+    scheduling.release();
+}
+
+timeout_t stack::remaining(call *cr)
+{
+    assert(cr != NULL);
+
+    timeout_t result = Timer::inf;
+    uint64_t now;
+
+    scheduling.acquire();
+    if(cr->slot) {
+        now = ticks();
+        if(cr->deadline > now)
+            result = (timeout_t)(cr->deadline - now);
+        else
+            result = 0;
+    }
+    scheduling.release();
+    return result;
+}
+
+stack::call *stack::due(timeout_t *next)
+{
+    assert(next != NULL);
+
+    call *cr = NULL;
+    uint64_t now;
+
+    *next = Timer::inf;
+    scheduling.acquire();
+    if(heaped) {
+        now = ticks();
+        cr = static_cast<call *>(heap[0]);
+        if(cr->deadline > now + 1) {
+            *next = (timeout_t)(cr->deadline - now);
+            cr = NULL;
+        }
+    }
+    scheduling.release();
+    return cr;
+}
+
+void stack::sift(unsigned index)
+{
+    // called with the heap locked; moves the entry at index up or down
+    // until the heap is again ordered.
+
+    call *cr = static_cast<call *>(heap[index]);
+    call *np;
+    unsigned child;
+
+    while(index) {
+        np = static_cast<call *>(heap[(index - 1) / 2]);
+        if(np->deadline <= cr->deadline)
+            break;
+        heap[index] = np;
+        np->slot = index + 1;
+        index = (index - 1) / 2;
+    }
+
+    for(;;) {
+        child = index * 2 + 1;
+        if(child >= heaped)
+            break;
+        if(child + 1 < heaped && static_cast<call *>(heap[child + 1])->deadline < static_cast<call *>(heap[child])->deadline)
+            ++child;
+        np = static_cast<call *>(heap[child]);
+        if(np->deadline >= cr->deadline)
+            break;
+        heap[index] = np;
+        np->slot = index + 1;
+        index = child;
+    }
+
+    heap[index] = cr;
+    cr->slot = index + 1;
+}
+
+void stack::unlist(session *s)
+{
+    assert(s != NULL && s->cid > 0);
+
+    rwlock_t *lock = &indexing[s->cid % keysize];
+
+    lock->modify();
+    s->delist(&hash[s->cid % keysize]);
+    lock->release();
+}
+
+stripelock *stack::stripe(call *cr)
+{
+    return &striping[((size_t)cr / sizeof(void *)) % stripes];
+}
+
 void stack::release(MappedCall *map)
 {
     if(map) {
+        mapped_modify(map);
         String::set(map->state, sizeof(map->state), "-");
         map->created = map->active = 0;
+        mapped_commit(map);
         mapping.lock();
         map->enlist(&freemaps);
         mapping.release();
@@ -623,6 +901,7 @@ MappedCall *stack::get(void)
     if(!map)
         return NULL;
 
+    mapped_modify(map);
     String::set(map->state, sizeof(map->state), "iinit");
     map->active = 0;
     map->authorized[0] = 0;
@@ -630,6 +909,7 @@ MappedCall *stack::get(void)
     map->target[0] = 0;
 
     time(&map->created);
+    mapped_commit(map);
     return map;
 }
 
@@ -655,10 +935,10 @@ stack::session *stack::create(voip::context_t context, call *cr, voip::call_t ci
     assert(cr != NULL);
     assert(cid > 0);
 
-    locking.exclusive();
+    stripe(cr)->exclusive();
     segment *sp = new segment(context, cr, cid);
     ++cr->invited;
-    locking.share();
+    stripe(cr)->share();
     return &sp->sid;
 }
 
@@ -679,8 +959,9 @@ stack::session *stack::create(voip::context_t context, voip::call_t cid, voip::d
     sp = new segment(context, cr, cid, did, tid);    // after count set to 0!
     cr->source = &(sp->sid);
     cr->map = map;
+    locking.commit();
 
-    locking.share();
+    stripe(cr)->access();
     return cr->source;
 }
 
@@ -689,8 +970,12 @@ stack::session *stack::access(voip::call_t cid)
     assert(cid > 0);
 
     linked_pointer<session> sp;
+    rwlock_t *index = &indexing[cid % keysize];
+    stripelock *lock;
+    call *cr;
 
-    locking.access();
+retry:
+    index->access();
     sp = hash[cid % keysize];
     while(sp) {
         if(sp->cid == cid)
@@ -698,16 +983,36 @@ stack::session *stack::access(voip::call_t cid)
         sp.next();
     }
     if(!sp) {
-        locking.release();
+        index->release();
         return NULL;
     }
+    cr = sp->parent;
+    index->release();
+
+    // the session may be cleared before its call stripe is held, so make
+    // sure it is still listed once we have it.
+
+    lock = stripe(cr);
+    lock->access();
+    index->access();
+    linked_pointer<session> cp = hash[cid % keysize];
+    while(cp) {
+        if(*cp == *sp && cp->cid == cid)
+            break;
+        cp.next();
+    }
+    index->release();
+    if(!cp) {
+        lock->release();
+        goto retry;
+    }
     return *sp;
 }
 
 void stack::detach(session *s)
 {
     if(s)
-        locking.release();
+        stripe(s->parent)->release();
 }
 
 void stack::start(service *cfg)
@@ -723,12 +1028,12 @@ void stack::start(service *cfg)
     if(!iface && sip_iface)
         iface = sip_iface;
 
-    thread *thr;
     shell::log(DEBUG1, "starting sip stack v%d; %d maps", ver, mapped_calls);
 
     mapped_array<MappedCall>::create(control::env("callmap"), mapped_calls);
     if(!sip)
         shell::log(shell::FAIL, "calls could not be mapped");
+    latency::start();
     initialize();
 
 #ifdef  HAVE_TLS
@@ -773,6 +1078,20 @@ void stack::start(service *cfg)
         out_context = udp_context;
     }
 
+    if(shards > 1 && udp_context) {
+        udp_shards = new voip::context_t[shards];
+        for(unsigned shard = 0; shard < shards; ++shard)
+            voip::create(&udp_shards[shard], agent, sip_family);
+        if(!udp_shards[0]) {
+            shell::log(shell::WARN, "udp shards not supported");
+            delete[] udp_shards;
+            udp_shards = NULL;
+            shards = 1;
+        }
+    }
+    else
+        shards = 1;
+
 #ifdef  HAVE_TLS
     voip::create(&tls_context, agent, sip_family);
 #endif
@@ -781,37 +1100,64 @@ void stack::start(service *cfg)
     eXosip_set_option(EXOSIP_OPT_DONT_SEND_101, &send101);
 #endif
 
-    threading = 0;
-    if(udp_context) {
-        ++threading;
+    if(udp_shards && !voip::listen_reuse(udp_shards[0], iface, sip_port, shards)) {
+        shell::log(shell::WARN, "cannot share port %u for udp shards", sip_port);
+        for(unsigned shard = 0; shard < shards; ++shard)
+            voip::release(udp_shards[shard]);
+        delete[] udp_shards;
+        udp_shards = NULL;
+        shards = 1;
+    }
+    else if(udp_shards)
+        udp_count = shards;
+
+    // saved registrations need transport contexts, and shards to be known,
+    // so are replayed here rather than in registry::start, before any
+    // requests are processed.
+    registry::restore();
+
+    // threading is the number of event threads for each transport context
+    unsigned started = 0;
+    if(overload_delay && threading < 2)
+        shell::log(shell::WARN, "overload delay needs threading 2 or more; only calls are limited");
+    if(udp_shards) {
+        shell::log(shell::NOTIFY, "listening port %u for udp; %u shards", sip_port, shards);
+        for(unsigned shard = 0; shard < shards; ++shard) {
+            if(shard && !voip::listen_reuse(udp_shards[shard], iface, sip_port, shards))
+                shell::log(shell::FAIL, "cannot listen port %u for udp shard %u", sip_port, shard);
+            started += thread::create(udp_shards[shard], "udp", threading, priority);
+        }
+
+        // port 0 has eXosip bind any free port
+        if(!voip::listen(udp_context, IPPROTO_UDP, iface, 0))
+            shell::log(shell::FAIL, "cannot listen for outgoing udp requests");
+        started += thread::create(udp_context, "udp", threading, priority);
+    }
+    else if(udp_context) {
         if(!voip::listen(udp_context, IPPROTO_UDP, iface, sip_port))
             shell::log(shell::FAIL, "cannot listen port %u for udp", sip_port);
         else
             shell::log(shell::NOTIFY, "listening port %u for udp", sip_port);
-        thr = new thread(udp_context, "udp");
-        thr->start(priority);
+        started += thread::create(udp_context, "udp", threading, priority);
     }
 
     if(tcp_context) {
-        ++threading;
         if(!voip::listen(tcp_context, IPPROTO_TCP, iface, sip_port))
             shell::log(shell::FAIL, "cannot listen port %u for tcp", sip_port);
         shell::log(shell::NOTIFY, "listening port %u for tcp", sip_port);
-        thr = new thread(tcp_context, "tcp");
-        thr->start(priority);
+        started += thread::create(tcp_context, "tcp", threading, priority);
 
     }
 
     if(tls_context) {
-        ++threading;
         if(!voip::listen(tls_context, IPPROTO_TCP, iface, sip_port, true))
             shell::log(shell::FAIL, "cannot listen port %u for tls", sip_port + 1);
         shell::log(shell::NOTIFY, "listening port %u for tls", sip_port + 1);
-        thr = new thread(tls_context, "tls");
-        thr->start(priority);
+        started += thread::create(tls_context, "tls", threading, priority);
     }
 
-    thread::wait(threading);
+    thread::wait(started);
+    trace::start();
     background::create(timing);
 }
 
@@ -822,7 +1168,9 @@ void stack::stop(service *cfg)
     shell::log(DEBUG1, "stopping sip stack");
     background::cancel();
     thread::shutdown();
+    trace::stop();
     Thread::yield();
+    latency::stop();
     MappedMemory::release();
     MappedMemory::remove(control::env("callmap"));
 }
@@ -839,6 +1187,11 @@ bool stack::check(void)
         voip::lock(udp_context);
         voip::unlock(udp_context);
     }
+    for(unsigned shard = 0; udp_shards && shard < shards; ++shard) {
+        shell::log(shell::INFO, "checking udp shard %u...", shard);
+        voip::lock(udp_shards[shard]);
+        voip::unlock(udp_shards[shard]);
+    }
     if(tls_context) {
         shell::log(shell::INFO, "checking tls context...");
         voip::lock(tls_context);
@@ -847,6 +1200,50 @@ bool stack::check(void)
     return true;
 }
 
+unsigned stack::overloaded(timeout_t delay)
+{
+    timeout_t max_delay = overload_delay;
+    unsigned max_calls = overload_calls;
+    unsigned calls = call::pool.getLive();
+    timeout_t average, smoothed;
+
+    do {
+        average = overload_average;
+        smoothed = (average * (OVERLOAD_WEIGHT - 1) + delay) / OVERLOAD_WEIGHT;
+    } while(!STACK_CAS(overload_average, average, smoothed));
+
+    if(overload_active) {
+        max_delay = (max_delay * 3) / 4;
+        max_calls = (max_calls * 3) / 4;
+    }
+
+    if((max_delay && smoothed > max_delay) || (max_calls && calls > max_calls)) {
+        if(STACK_CAS(overload_active, 0, 1))
+            shell::log(shell::WARN, "overloaded; delay=%ld, calls=%u", (long)smoothed, calls);
+        STACK_INC(overload_rejects);
+        return retry_after ? retry_after : 1;
+    }
+
+    if(STACK_CAS(overload_active, 1, 0))
+        shell::log(shell::NOTIFY, "overload cleared");
+    return 0;
+}
+
+bool stack::isDatagram(voip::context_t context)
+{
+    if(!context)
+        return false;
+
+    if(context == udp_context)
+        return true;
+
+    for(unsigned shard = 0; udp_shards && shard < shards; ++shard) {
+        if(context == udp_shards[shard])
+            return true;
+    }
+    return false;
+}
+
 void stack::snapshot(FILE *fp)
 {
     assert(fp != NULL);
@@ -855,10 +1252,15 @@ void stack::snapshot(FILE *fp)
     fprintf(fp, "SIP:\n");
     locking.access();
     fprintf(fp, "  mapped calls: %d\n", mapped_calls);
-    fprintf(fp, "  active calls: %d\n", active_calls);
-    fprintf(fp, "  active sessions: %d\n", active_segments);
-    fprintf(fp, "  allocated calls: %d\n", allocated_calls);
-    fprintf(fp, "  allocated sessions: %d\n", allocated_segments);
+    fprintf(fp, "  active calls: %d\n", call::pool.getLive());
+    fprintf(fp, "  active sessions: %d\n", segment::pool.getLive());
+    fprintf(fp, "  allocated calls: %d\n", call::pool.getAllocated());
+    fprintf(fp, "  allocated sessions: %d\n", segment::pool.getAllocated());
+    fprintf(fp, "  armed timers: %d\n", heaped);
+    fprintf(fp, "  udp shards: %d\n", shards);
+    fprintf(fp, "  queue delay: %ld msec\n", (long)overload_average);
+    fprintf(fp, "  overload rejects: %lu\n", (unsigned long)overload_rejects);
+    trace::snapshot(fp);
     cp = begin();
     while(cp) {
         cp.next();
@@ -907,6 +1309,16 @@ void stack::reload(service *cfg)
                 dumping = tobool(value);
             else if(eq(key, "keysize") && !is_configured())
                 keysize = atoi(value);
+            else if(eq(key, "stripes") && !is_configured())
+                stripes = atoi(value);
+            else if(eq(key, "shards") && !is_configured())
+                shards = atoi(value);
+            else if(eq(key, "overload"))
+                overload_delay = atoi(value);
+            else if(eq(key, "calls"))
+                overload_calls = atoi(value);
+            else if(eq(key, "retry"))
+                retry_after = atoi(value);
             else if(eq(key, "interface") && !is_configured()) {
                 sip_family = AF_INET;
                 sip_iface = NULL;
@@ -1026,6 +1438,14 @@ void stack::reload(service *cfg)
     if(!hash) {
         hash = new LinkedObject*[keysize];
         memset(hash, 0, sizeof(LinkedObject *) * keysize);
+        indexing = new rwlock_t[keysize];
+    }
+    if(!striping) {
+        if(!stripes)
+            stripes = 1;
+        striping = new stripelock[stripes];
+        for(unsigned index = 0; index < stripes; ++index)
+            striping[index].slot = latency::STACK_LOCK;
     }
 }
 
@@ -1396,12 +1816,13 @@ int stack::inviteRemote(stack::session *s, const char *uri_target, const char *d
 
     invited = stack::create(context, call, cid);
     registry::incUse(NULL, stats::OUTGOING);
-    String::set(invited->identity, sizeof(invited->identity), uri_target);
-    String::set(invited->display, sizeof(invited->display), username);
-    snprintf(invited->from, sizeof(invited->from), "<%s>", uri_target);
+    invited->identity = call->dup(uri_target);
+    invited->display = call->dup(username);
+    invited->from = call->format("<%s>", uri_target);
     String::set(invited->network, sizeof(invited->network), network);
     invited->nat = nat;
-    uri::identity(*resolv, invited->sysident, username, sizeof(invited->sysident));
+    uri::identity(*resolv, route, username, sizeof(route));
+    invited->sysident = call->dup(route);
     invited->peering = peering;
 
     shell::debug(3, "inviting %s\n", uri_target);
@@ -1420,7 +1841,7 @@ repeat:
     char buffer[MAX_URI_SIZE];
     registry::mapped *rr = NULL;
 
-    String::set(cr->divert, sizeof(cr->divert), cr->forward);
+    cr->divert = cr->forward;
     cr->forwarding = NULL;
     cr->diverting = NULL;
 
@@ -1448,8 +1869,7 @@ repeat:
     if(strchr(target, '@'))
         goto remote;
 
-    String::set(cr->forward, sizeof(cr->forward), target);
-    target = cr->forward;
+    target = cr->forward = cr->dup(target);
     server::release(user);
 
     shell::debug(3, "call forward <%s> to %s", forwarding, target);
@@ -1611,22 +2031,23 @@ int stack::inviteLocal(stack::session *s, registry::mapped *rr, destination_t de
         invited->nat = nat;
 
         if(rr->ext)
-            snprintf(invited->sysident, sizeof(invited->sysident), "%u", rr->ext);
+            invited->sysident = call->format("%u", rr->ext);
         else
-            String::set(invited->sysident, sizeof(invited->sysident), rr->userid);
+            invited->sysident = call->dup(rr->userid);
         if(rr->display[0])
-            String::set(invited->display, sizeof(invited->display), rr->display);
+            invited->display = call->dup(rr->display);
         else
-            String::set(invited->display, sizeof(invited->display), invited->sysident);
-        stack::sipPublish((struct sockaddr_internet *)&tp->peering, invited->identity, invited->sysident, sizeof(invited->identity));
+            invited->display = invited->sysident;
+        stack::sipPublish((struct sockaddr_internet *)&tp->peering, route, invited->sysident, sizeof(route));
+        invited->identity = call->dup(route);
         if(rr->ext && !rr->display[0])
-            snprintf(invited->from, sizeof(invited->from),
+            invited->from = call->format(
                 "\"%s\" <%s;user=phone>", invited->sysident, invited->identity);
         else if(rr->display[0])
-            snprintf(invited->from, sizeof(invited->from),
+            invited->from = call->format(
                 "\"%s\" <%s>", rr->display, invited->identity);
         else
-            snprintf(invited->from, sizeof(invited->from),
+            invited->from = call->format(
                 "<%s>", invited->identity);
         registry::incUse(rr, stats::OUTGOING);
         invited->reg = rr;
@@ -38,9 +38,11 @@ static shell::flagopt althelp('?', NULL, NULL);
 static shell::stringopt iface('A', "--address", _TEXT("sip interface address"), "address", NULL);
 static shell::numericopt port('P', "--port", _TEXT("sip port to bind"), "port", 5060);
 static shell::flagopt backflag('b', "--background", _TEXT("run in background"));
+static shell::numericopt benchmark(0, "--benchmark", _TEXT("benchmark media relay"), "streams", 0);
 static shell::flagopt altback('d', NULL, NULL);
 static shell::flagopt dump('D', "--dump-config", _TEXT("show configuration"));
 static shell::numericopt concurrency('c', "--concurrency", _TEXT("process concurrency"), "level");
+static shell::numericopt contention(0, "--contention", _TEXT("benchmark registry locking"), "entries", 0);
 static shell::flagopt desktop(0, "--desktop", _TEXT("enable desktop access"));
 static shell::flagopt foreflag('f', "--foreground", _TEXT("run in foreground"));
 #ifdef  HAVE_PWD_H
@@ -261,12 +263,26 @@ static void init(int argc, char **argv, bool detached, shell::mainproc_t svc = N
     if(is(version))
         versioninfo();
 
+    if(is(benchmark)) {
+        cp = args.getenv("BENCHMARK_SECONDS");
+        ::exit(bench::measure(*benchmark, cp ? atoi(cp) : 10, is(concurrency) ? *concurrency : 1));
+    }
+
+    if(is(contention)) {
+        cp = args.getenv("BENCHMARK_SECONDS");
+        args.setsym("regmap", REGISTRY_MAP "-bench");
+        args.setsym("statmap", STAT_MAP "-bench");
+        control::config(&args);
+        ::exit(bench::contention(*contention, cp ? atoi(cp) : 10, is(concurrency) ? *concurrency : 4));
+    }
+
     // cheat out shell parser...
     // argv[0] = (char *)"sipwitch";
 
     args.setsym("statmap", STAT_MAP);
     args.setsym("callmap", CALL_MAP);
     args.setsym("regmap", REGISTRY_MAP);
+    args.setsym("latencymap", LATENCY_MAP);
 
 #ifdef _MSWINDOWS_
     rundir = strdup(str(args.getenv("APPDATA")) + "/sipwitch");
@@ -277,7 +293,7 @@ static void init(int argc, char **argv, bool detached, shell::mainproc_t svc = N
     args.setsym("control", "\\\\.\\mailslot\\sipwitch_ctrl");
     args.setsym("cache", _STR(str(prefix) + "/cache"));
     args.setsym("logfiles", _STR(str(prefix) + "/logs"));
-    args.setsym("siplogs", _STR(str(prefix) + "/logs/siptrace.log"));
+    args.setsym("siplogs", _STR(str(prefix) + "/logs/siptrace.pcap"));
     args.setsym("logfile", _STR(str(prefix) + "/logs/sipwitch.log"));
     args.setsym("calls", _STR(str(prefix) + "/logs/sipwitch.calls"));
     args.setsym("stats", _STR(str(prefix) + "/logs/sipwitch.stats"));
@@ -302,7 +318,7 @@ static void init(int argc, char **argv, bool detached, shell::mainproc_t svc = N
     args.setsym("events", DEFAULT_VARPATH "/run/sipwitch/events");
     args.setsym("config", DEFAULT_CFGPATH "/sipwitch.conf");
     args.setsym("logfiles", DEFAULT_VARPATH "/log");
-    args.setsym("siplogs", DEFAULT_VARPATH "/log/siptrace.log");
+    args.setsym("siplogs", DEFAULT_VARPATH "/log/siptrace.pcap");
     args.setsym("logfile", DEFAULT_VARPATH "/log/sipwitch.log");
     args.setsym("calls", DEFAULT_VARPATH "/log/sipwitch.calls");
     args.setsym("stats", DEFAULT_VARPATH "/log/sipwitch.stats");
@@ -329,6 +345,7 @@ static void init(int argc, char **argv, bool detached, shell::mainproc_t svc = N
         args.setsym("statmap", _STR(str(STAT_MAP "-") + str(pwd->pw_name)));
         args.setsym("callmap", _STR(str(CALL_MAP "-") + str(pwd->pw_name)));
         args.setsym("regmap", _STR(str(REGISTRY_MAP "-") + str(pwd->pw_name)));
+        args.setsym("latencymap", _STR(str(LATENCY_MAP "-") + str(pwd->pw_name)));
 
         cp = userpath(*configpath);
         if(is(configpath) && fsys::is_file(cp))
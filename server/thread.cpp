@@ -18,6 +18,13 @@
 
 namespace sipwitch {
 
+// With more than one thread per context, a receiving thread takes every
+// event from the context and queues it to a worker picked by call id (or
+// dialog, transaction, or registration id), so the events of one dialog
+// are still handled in order while different dialogs run in parallel.
+
+#define EVENT_QUEUE     256
+
 static volatile bool warning_registry = false;
 static bool shutdown_flag = false;
 static unsigned shutdown_count = 0;
@@ -52,6 +59,73 @@ thread::thread(voip::context_t ctx, const char *tag) : DetachedThread(stack::sip
     session = NULL;
     instance = tag;
     context = ctx;
+    workers = NULL;
+    pool = running = 0;
+    receiver = NULL;
+    events = NULL;
+    posted = NULL;
+    head = tail = pending = 0;
+    delay = 0;
+}
+
+unsigned thread::create(voip::context_t ctx, const char *tag, unsigned count, int priority)
+{
+    thread *thr = new thread(ctx, tag);
+    unsigned index;
+
+    if(count > 1) {
+        thr->workers = new thread *[count];
+        thr->pool = thr->running = count;
+        for(index = 0; index < count; ++index) {
+            thr->workers[index] = new thread(ctx, tag);
+            thr->workers[index]->receiver = thr;
+            thr->workers[index]->events = new voip::event_t[EVENT_QUEUE];
+            thr->workers[index]->posted = new uint64_t[EVENT_QUEUE];
+            thr->workers[index]->start(priority);
+        }
+    }
+    else
+        count = 0;
+
+    thr->start(priority);
+    return count + 1;
+}
+
+void thread::post(voip::event_t ev)
+{
+    Conditional::lock();
+    while(pending >= EVENT_QUEUE && !shutdown_flag)
+        Conditional::wait(stack::sip.timing);
+    if(pending >= EVENT_QUEUE) {
+        Conditional::unlock();
+        voip::release_event(ev);
+        return;
+    }
+    events[tail] = ev;
+    posted[tail] = latency::now();
+    tail = (tail + 1) % EVENT_QUEUE;
+    ++pending;
+    Conditional::broadcast();
+    Conditional::unlock();
+}
+
+voip::event_t thread::fetch(timeout_t timeout)
+{
+    voip::event_t ev = NULL;
+
+    Conditional::lock();
+    if(!pending)
+        Conditional::wait(timeout);
+    if(pending) {
+        ev = events[head];
+        delay = (timeout_t)((latency::now() - posted[head]) / 1000000l);
+        latency::record(latency::QUEUE, posted[head]);
+        head = (head + 1) % EVENT_QUEUE;
+        --pending;
+        Conditional::broadcast();
+    }
+    Conditional::unlock();
+    return ev;
 }
 
 const char *thread::eid(eXosip_event_type ev)
@@ -357,7 +431,8 @@ void thread::invite(void)
     cdr *cdrnode = NULL;
     const char *domain = registry::getDomain();
 
-    uri::serviceid(requesting, call->request, sizeof(call->request));
+    uri::serviceid(requesting, buftemp, sizeof(buftemp));
+    call->request = call->dup(buftemp);
 
     if(!domain)
         domain = requesting;
@@ -395,9 +470,9 @@ void thread::invite(void)
     msgheader = NULL;
     osip_message_get_subject(sevent->request, 0, &msgheader);
     if(msgheader && msgheader->hvalue && msgheader->hvalue[0])
-        String::set(call->subject, sizeof(call->subject), msgheader->hvalue);
+        call->subject = call->dup(msgheader->hvalue);
     else
-        String::set(call->subject, sizeof(call->subject), "inviting call");
+        call->subject = call->dup("inviting call");
 
     msgheader = NULL;
     osip_message_get_expires(sevent->request, 0, &msgheader);
@@ -408,7 +483,7 @@ void thread::invite(void)
 
     osip_message_get_body(sevent->request, 0, &body);
     if(body && body->body)
-        String::set(session->sdp, sizeof(session->sdp), body->body);
+        call->setSDP(session, body->body);
 
     if(dialed.keys) {
         target = service::getValue(dialed.keys, "extension");
@@ -434,46 +509,46 @@ void thread::invite(void)
     switch(destination) {
     case LOCAL:
         if(extension)
-            snprintf(session->sysident, sizeof(session->sysident), "%u", extension);
+            session->sysident = call->format("%u", extension);
         else
-            String::set(session->sysident, sizeof(session->sysident), identity);
+            session->sysident = call->dup(identity);
         if(display[0])
-            String::set(session->display, sizeof(session->display), display);
+            session->display = call->dup(display);
         else
-            String::set(session->display, sizeof(session->display), session->sysident);
+            session->display = session->sysident;
 
-        String::set(call->dialed, sizeof(call->dialed), dialing);
+        call->dialed = call->dup(dialing);
         String::set(cdrnode->ident, sizeof(cdrnode->ident), session->sysident);
         String::set(cdrnode->dialed, sizeof(cdrnode->dialed), call->dialed);
         String::set(cdrnode->display, sizeof(cdrnode->display), session->display);
-        snprintf(session->identity, sizeof(session->identity), "%s:%s@%s",
+        session->identity = call->format("%s:%s@%s",
             stack::sip.getScheme(), session->sysident, domain);
 
         if(toext) {
             call->phone = true;
-            snprintf(call->dialed, sizeof(call->dialed), "%u", toext);
+            call->dialed = call->format("%u", toext);
         }
         else
-            String::set(call->dialed, sizeof(call->dialed), target);
+            call->dialed = call->dup(target);
 
         if(reginfo && !strcmp(reginfo->userid, identity)) {
             shell::debug(1, "calling self %08x:%u, id=%s\n",
                 session->sequence, session->cid, getIdent());
 
-            String::set(call->subject, sizeof(call->subject), "calling self");
+            call->subject = call->dup("calling self");
             call->busy(this);
             cdr::post(cdrnode);
             return;
         }
 
         if(extension && !display[0])
-            snprintf(session->from, sizeof(session->from),
+            session->from = call->format(
                 "\"%s\" <%s;user=phone>", session->sysident, session->identity);
         else if(display[0])
-            snprintf(session->from, sizeof(session->from),
+            session->from = call->format(
                 "\"%s\" <%s>", session->display, session->identity);
         else
-            snprintf(session->from, sizeof(session->from),
+            session->from = call->format(
                 "<%s>", session->identity);
 
         session->closed = false;
@@ -482,18 +557,18 @@ void thread::invite(void)
             session->sequence, session->cid, call->dialed, session->sysident);
         break;
     case PUBLIC:
-        String::set(call->dialed, sizeof(call->dialed), target);
-        snprintf(session->identity, sizeof(session->identity), "%s:%s@%s:%s",
+        call->dialed = call->dup(target);
+        session->identity = call->format("%s:%s@%s:%s",
             from->url->scheme, from->url->username, from->url->host, from->url->port);
-        snprintf(session->sysident, sizeof(session->sysident), "%s@%s", from->url->username, from->url->host);
+        session->sysident = call->format("%s@%s", from->url->username, from->url->host);
         if(from->displayname) {
-            String::set(session->display, sizeof(session->display), from->displayname);
-            snprintf(session->from, sizeof(session->from),
+            session->display = call->dup(from->displayname);
+            session->from = call->format(
                 "\"%s\" <%s>", from->displayname, session->identity);
         }
         else {
-            String::set(session->display, sizeof(session->display), from->url->username);
-            snprintf(session->from, sizeof(session->from),
+            session->display = call->dup(from->url->username);
+            session->from = call->format(
                 "<%s>", session->identity);
         }
         shell::debug(1, "incoming call %08x:%u for %s from %s\n",
@@ -508,37 +583,39 @@ void thread::invite(void)
     case REDIRECTED:
     case EXTERNAL:
         if(extension)
-            snprintf(session->sysident, sizeof(session->sysident), "%u", extension);
+            session->sysident = call->format("%u", extension);
         else
-            String::set(session->sysident, sizeof(session->sysident), identity);
+            session->sysident = call->dup(identity);
         session->reg = registry::invite(identity, stats::INCOMING);
         if(display[0])
-            String::set(session->display, sizeof(session->display), display);
+            session->display = call->dup(display);
         else
-            String::set(session->display, sizeof(session->display), identity);
+            session->display = call->dup(identity);
 
         if(registry::getDomain() || destination != EXTERNAL)
-            snprintf(session->identity, sizeof(session->identity), "%s:%s@%s",
+            session->identity = call->format("%s:%s@%s",
                 stack::sip.getScheme(), session->sysident, domain);
         else {
             gethostname(buftemp, sizeof(buftemp));
-            snprintf(session->identity, sizeof(session->identity), "%s:%s@%s",
+            session->identity = call->format("%s:%s@%s",
                 stack::sip.getScheme(), session->sysident, buftemp);
         }
 
-        if(destination == EXTERNAL)
-            uri::identity(request_address.getAddr(), call->dialed, uri->username, sizeof(call->dialed));
+        if(destination == EXTERNAL) {
+            uri::identity(request_address.getAddr(), buftemp, uri->username, sizeof(buftemp));
+            call->dialed = call->dup(buftemp);
+        }
         else
-            String::set(call->dialed, sizeof(call->dialed), dialing);
+            call->dialed = call->dup(dialing);
 
         if(extension && !display[0])
-            snprintf(session->from, sizeof(session->from),
+            session->from = call->format(
                 "\"%s\" <%s;user=phone>", session->sysident, session->identity);
         else if(display[0])
-            snprintf(session->from, sizeof(session->from),
+            session->from = call->format(
                 "\"%s\" <%s>", display, session->identity);
         else
-            snprintf(session->from, sizeof(session->from),
+            session->from = call->format(
                 "<%s>", session->identity);
 
         shell::debug(1, "outgoing call %08x:%u from %s to %s",
@@ -558,25 +635,25 @@ void thread::invite(void)
         call->phone = true;
 
         if(extension)
-            snprintf(session->sysident, sizeof(session->sysident), "%u", extension);
+            session->sysident = call->format("%u", extension);
         else
-            String::set(session->sysident, sizeof(session->sysident), identity);
+            session->sysident = call->dup(identity);
         if(display[0])
-            String::set(session->display, sizeof(session->display), display);
+            session->display = call->dup(display);
         else
-            String::set(session->display, sizeof(session->display), session->sysident);
+            session->display = session->sysident;
 
-        snprintf(session->identity, sizeof(session->identity), "%s:%s@%s",
+        session->identity = call->format("%s:%s@%s",
             stack::sip.getScheme(), session->sysident, domain);
 
         if(extension)
-            snprintf(session->from, sizeof(session->from),
+            session->from = call->format(
                 "\"%s\" <%s;user=phone>", session->display, session->identity);
         else
-            snprintf(session->from, sizeof(session->from),
+            session->from = call->format(
                 "\"%s\" <%s>", session->display, session->identity);
 
-        String::set(call->dialed, sizeof(call->dialed), dialing);
+        call->dialed = call->dup(dialing);
 
         String::set(cdrnode->ident, sizeof(cdrnode->ident), session->sysident);
         String::set(cdrnode->dialed, sizeof(cdrnode->dialed), call->dialed);
@@ -594,15 +671,17 @@ void thread::invite(void)
         break;
     }
 
+    mapped_modify(call->map);
     call->map->sequence = session->sequence;
     call->map->cid = session->cid;
     String::set(call->map->source, sizeof(call->map->source), session->sysident);
     String::set(call->map->display, sizeof(call->map->display), session->display);
+    mapped_commit(call->map);
     if(reginfo) {
         // get rid of config ref if we are calling registry target
         server::release(dialed);
 
-        String::set(call->forward, MAX_USERID_SIZE, reginfo->userid);
+        call->forward = call->dup(reginfo->userid);
         call->forwarding = "na";
         stack::inviteLocal(session, reginfo, destination);
     }
@@ -1178,17 +1257,22 @@ redirect:
     return true;
 }
 
-void thread::send_reply(int error)
+void thread::send_reply(int error, unsigned retry)
 {
     assert(error >= 100);
 
     voip::msg_t reply = NULL;
+    char value[16];
+
+    snprintf(value, sizeof(value), "%u", retry);
 
     switch(authorizing) {
     case CALL:
         if(voip::make_answer_response(context, sevent->tid, error, &reply)) {
-            if(context == stack::sip.udp_context)
+            if(stack::isDatagram(context))
                 voip::server_requires(reply, "100rel");
+            if(retry)
+                voip::header(reply, "Retry-After", value);
             stack::siplog(reply);
             voip::send_answer_response(context, sevent->tid, error, reply);
         }
@@ -1198,8 +1282,10 @@ void thread::send_reply(int error)
     case REGISTRAR:
     case MESSAGE:
         if(voip::make_response_message(context, sevent->tid, error, &reply)) {
-            if(context == stack::sip.udp_context)
+            if(stack::isDatagram(context))
                 voip::server_requires(reply, "100rel");
+            if(retry)
+                voip::header(reply, "Retry-After", value);
             stack::siplog(reply);
             voip::send_response_message(context, sevent->tid, error, reply);
         }
@@ -1849,6 +1935,8 @@ void thread::run(void)
 {
     time_t current, prior = 0;
     voip::body_t body;
+    unsigned retry, slot;
+    uint64_t started;
 
     ++startup_count;
     shell::log(DEBUG1, "starting event thread %s", instance);
@@ -1864,8 +1952,13 @@ void thread::run(void)
         extension = 0;
         identbuf[0] = 0;
 
-        if(!shutdown_flag)
+        if(!shutdown_flag && events)
+            sevent = fetch(stack::sip.timing);
+        else if(!shutdown_flag) {
+            // queue delay inside eXosip is not seen by a single thread
+            delay = 0;
             sevent = voip::get_event(context, stack::sip.timing);
+        }
 
         activated = false;
         accepted = NULL;
@@ -1876,27 +1969,67 @@ void thread::run(void)
 
         if(shutdown_flag) {
             shell::log(DEBUG1, "stopping event thread %s", instance);
-            voip::release(context);
+            if(events) {
+                while(pending) {
+                    voip::release_event(events[head]);
+                    head = (head + 1) % EVENT_QUEUE;
+                    --pending;
+                }
+                receiver->Conditional::lock();
+                --receiver->running;
+                receiver->Conditional::broadcast();
+                receiver->Conditional::unlock();
+            }
+            else {
+                // workers may still be replying through the context
+                Conditional::lock();
+                while(running)
+                    Conditional::wait(stack::sip.timing);
+                Conditional::unlock();
+                voip::release(context);
+            }
             ++shutdown_count;
             return; // exits thread...
         }
 
-        time(&current);
-        if(current != prior) {
-            prior = current;
-            voip::automatic_action(context);
+        if(!events) {
+            time(&current);
+            if(current != prior) {
+                prior = current;
+                voip::automatic_action(context);
+            }
+        }
+
+        // an idle thread still hands in its sampled lock waits
+        if(!sevent) {
+            latency::flush();
+            continue;
         }
 
-        if(!sevent)
+        if(pool) {
+            if(sevent->cid > 0)
+                workers[sevent->cid % pool]->post(sevent);
+            else if(sevent->did > 0)
+                workers[sevent->did % pool]->post(sevent);
+            else if(sevent->tid > 0)
+                workers[sevent->tid % pool]->post(sevent);
+            else if(sevent->rid > 0)
+                workers[sevent->rid % pool]->post(sevent);
+            else
+                workers[0]->post(sevent);
+            sevent = NULL;
             continue;
+        }
 
         ++active_count;
+        started = latency::now();
+        slot = latency::event(sevent->type);
         shell::debug(2, "sip: event %s(%d); cid=%d, did=%d, instance=%s",
             eid(sevent->type), sevent->type, sevent->cid, sevent->did, instance);
 
         switch(sevent->type) {
         case EXOSIP_REGISTRATION_FAILURE:
-            stack::siplog(sevent->response);
+            stack::siplog(sevent->response, true);
             shell::debug(4, "sip: registration response %d", sevent->response->status_code);
             if(sevent->response && sevent->response->status_code == 401) {
                 sip_realm = NULL;
@@ -1914,7 +2047,7 @@ void thread::run(void)
             break;
 #ifndef EXOSIP_API4
         case EXOSIP_REGISTRATION_TERMINATED:
-            stack::siplog(sevent->response);
+            stack::siplog(sevent->response, true);
             server::registration(sevent->rid, modules::REG_FAILED);
             break;
 #endif
@@ -1922,17 +2055,17 @@ void thread::run(void)
 #ifndef EXOSIP_API4
         case EXOSIP_REGISTRATION_REFRESHED:
 #endif
-            stack::siplog(sevent->response);
+            stack::siplog(sevent->response, true);
             server::registration(sevent->rid, modules::REG_SUCCESS);
             break;
         case EXOSIP_CALL_PROCEEDING:
-            stack::siplog(sevent->response);
+            stack::siplog(sevent->response, true);
             session = stack::access(sevent->cid);
             if(session)
                 stack::setDialog(session, sevent->did);
             break;
         case EXOSIP_CALL_ACK:
-            stack::siplog(sevent->ack);
+            stack::siplog(sevent->ack, true);
             authorizing = CALL;
             if(sevent->cid <= 0)
                 break;
@@ -1942,7 +2075,7 @@ void thread::run(void)
             session->parent->confirm(this, session);
             break;
         case EXOSIP_CALL_CANCELLED:
-            stack::siplog(sevent->response);
+            stack::siplog(sevent->response, true);
             authorizing = CALL;
             if(sevent->cid > 0) {
                 session = stack::access(sevent->cid);
@@ -1954,7 +2087,7 @@ void thread::run(void)
             send_reply(SIP_OK);
             break;
         case EXOSIP_CALL_NOANSWER:
-            stack::siplog(sevent->response);
+            stack::siplog(sevent->response, true);
             authorizing = CALL;
             if(sevent->cid <= 0)
                 break;
@@ -1964,7 +2097,7 @@ void thread::run(void)
             stack::close(session);
             break;
         case EXOSIP_CALL_ANSWERED:
-            stack::siplog(sevent->response);
+            stack::siplog(sevent->response, true);
             authorizing = CALL;
             if(!sevent->response || sevent->cid <= 0)
                 break;
@@ -1992,7 +2125,7 @@ void thread::run(void)
             break;
 #ifndef EXOSIP_API4
         case EXOSIP_CALL_TIMEOUT:
-            stack::siplog(sevent->response);
+            stack::siplog(sevent->response, true);
             authorizing = CALL;
             if(sevent->cid <= 0)
                 break;
@@ -2007,7 +2140,7 @@ void thread::run(void)
         case EXOSIP_CALL_GLOBALFAILURE:
         case EXOSIP_CALL_MESSAGE_REQUESTFAILURE:
         case EXOSIP_CALL_MESSAGE_SERVERFAILURE:
-            stack::siplog(sevent->response);
+            stack::siplog(sevent->response, true);
             authorizing = CALL;
             if(!sevent->response || sevent->cid <= 0)
                 break;
@@ -2051,7 +2184,7 @@ void thread::run(void)
             }
             break;
         case EXOSIP_CALL_CLOSED:
-            stack::siplog(sevent->response);
+            stack::siplog(sevent->response, true);
             authorizing = CALL;
             if(sevent->cid > 0) {
                 session = stack::access(sevent->cid);
@@ -2062,7 +2195,7 @@ void thread::run(void)
             }
             break;
         case EXOSIP_CALL_RELEASED:
-            stack::siplog(sevent->response);
+            stack::siplog(sevent->response, true);
             authorizing = NONE;
             if(sevent->cid > 0) {
                 authorizing = CALL;
@@ -2072,7 +2205,7 @@ void thread::run(void)
             }
             break;
         case EXOSIP_CALL_RINGING:
-            stack::siplog(sevent->response);
+            stack::siplog(sevent->response, true);
             authorizing = NONE;
             if(sevent->cid > 0) {
                 authorizing = CALL;
@@ -2085,7 +2218,7 @@ void thread::run(void)
             break;
 
         case EXOSIP_CALL_REINVITE:
-            stack::siplog(sevent->request);
+            stack::siplog(sevent->request, true);
             authorizing = CALL;
             if(!sevent->request)
                 break;
@@ -2103,12 +2236,17 @@ void thread::run(void)
             session->parent->reinvite(this, session);
             break;
         case EXOSIP_CALL_INVITE:
-            stack::siplog(sevent->request);
+            stack::siplog(sevent->request, true);
             authorizing = CALL;
             if(!sevent->request)
                 break;
             if(sevent->cid < 1)
                 break;
+            retry = stack::overloaded(delay);
+            if(retry) {
+                send_reply(SIP_SERVICE_UNAVAILABLE, retry);
+                break;
+            }
             expiration();
             session = stack::create(context, sevent->cid, sevent->did, sevent->tid);
             if(!session) {
@@ -2120,7 +2258,7 @@ void thread::run(void)
                 invite();
             break;
         case EXOSIP_CALL_MESSAGE_ANSWERED:
-            stack::siplog(sevent->response);
+            stack::siplog(sevent->response, true);
             authorizing = CALL;
             if(!sevent->response)
                 break;
@@ -2131,7 +2269,7 @@ void thread::run(void)
                 session->parent->relay(this, session);
             break;
         case EXOSIP_MESSAGE_ANSWERED:
-            stack::siplog(sevent->response);
+            stack::siplog(sevent->response, true);
             authorizing = MESSAGE;
             if(!sevent->response)
                 break;
@@ -2144,7 +2282,7 @@ void thread::run(void)
                 send_reply(SIP_NOT_FOUND);
             break;
         case EXOSIP_CALL_MESSAGE_NEW:
-            stack::siplog(sevent->request);
+            stack::siplog(sevent->request, true);
             authorizing = CALL;
             if(MSG_IS_BYE(sevent->request)) {
                 if(sevent->cid > 0)
@@ -2164,10 +2302,20 @@ void thread::run(void)
             }
             break;
         case EXOSIP_MESSAGE_NEW:
-            stack::siplog(sevent->request);
+            stack::siplog(sevent->request, true);
             authorizing = MESSAGE;
             if(!sevent->request)
                 break;
+            // requests within a dialog are still served when overloaded
+            if(!MSG_IS_BYE(sevent->request) && !MSG_IS_REFER(sevent->request) && !MSG_IS_INFO(sevent->request)) {
+                retry = stack::overloaded(delay);
+                if(retry) {
+                    if(MSG_IS_REGISTER(sevent->request))
+                        authorizing = REGISTRAR;
+                    send_reply(SIP_SERVICE_UNAVAILABLE, retry);
+                    break;
+                }
+            }
             expiration();
             if(MSG_IS_OPTIONS(sevent->request))
                 options();
@@ -2205,18 +2353,17 @@ void thread::run(void)
                 shell::debug(2, "unsupported %s in dialog", sevent->request->sip_method);
                 break;
             }
-            if(sevent->cid > 0) {
+            if(!session && sevent->cid > 0)
                 session = stack::access(sevent->cid);
-                if(session)
-                    stack::infomsg(session, sevent);
-            }
+            if(session)
+                stack::infomsg(session, sevent);
             send_reply(SIP_OK);
             break;
         default:
             if(sevent->response)
-                stack::siplog(sevent->response);
+                stack::siplog(sevent->response, true);
             else
-                stack::siplog(sevent->request);
+                stack::siplog(sevent->request, true);
             shell::log(shell::WARN, "unknown message");
         }
 
@@ -2252,6 +2399,7 @@ void thread::run(void)
         server::release(authorized);
         server::release(dialed);
         voip::release_event(sevent);
+        latency::record(slot, started);
         --active_count;
     }
 }
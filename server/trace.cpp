@@ -0,0 +1,442 @@
+// Copyright (C) 2006-2014 David Sugar, Tycho Softworks.
+// Copyright (C) 2015 Cherokees of Idaho.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "server.h"
+
+namespace sipwitch {
+
+// Event threads only claim a slot in a bounded ring with a compare and
+// swap and leave a clone of the traced message there; when the ring is
+// full the message is counted as dropped rather than waiting.  A single
+// writer thread drains the ring every so often, serializes the messages,
+// and appends them to the trace as pcap records with synthesized ip and
+// udp headers, so the trace opens in the usual packet tools.  The trace is
+// rotated to a ".1" file when it grows past its limit.
+
+#define TRACE_RING      4096    // must be a power of two
+#define TRACE_LIMIT     (16l * 1024l * 1024l)
+#define TRACE_PERIOD    100
+#define TRACE_PAYLOAD   (65535 - 48)
+
+#if defined(__GNUC__)
+#define TRACE_CAS(x, o, n)  __sync_bool_compare_and_swap(&(x), o, n)
+#define TRACE_INC(x)        __sync_add_and_fetch(&(x), 1)
+#else
+#define TRACE_CAS(x, o, n)  ((x) == (o) ? ((x) = (n), true) : false)
+#define TRACE_INC(x)        (++(x))
+#endif
+
+typedef struct {
+    volatile unsigned sequence;
+    voip::msg_t msg;
+    struct timeval stamp;
+    bool inbound;
+} record_t;
+
+typedef struct {
+    uint32_t magic;
+    uint16_t major, minor;
+    int32_t zone;
+    uint32_t sigfigs, snaplen, network;
+} pcap_file_t;
+
+typedef struct {
+    uint32_t seconds, micro;
+    uint32_t captured, length;
+} pcap_record_t;
+
+static record_t ring[TRACE_RING];
+static volatile unsigned head = 0;
+static unsigned tail = 0;
+static volatile unsigned long dropped = 0;
+static volatile unsigned long written = 0;
+static volatile bool stopping = false;
+static volatile bool active = false;
+
+trace *trace::writer = NULL;
+
+static void inaddr(struct sockaddr_storage *addr, const char *host, const char *port, unsigned defport)
+{
+    unsigned short pn = defport;
+
+    memset(addr, 0, sizeof(struct sockaddr_storage));
+    if(port && atoi(port) > 0)
+        pn = atoi(port);
+
+#ifdef  AF_INET6
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+    if(host && strchr(host, ':')) {
+        char buf[64];
+        if(*host == '[') {
+            String::set(buf, sizeof(buf), ++host);
+            char *ep = strchr(buf, ']');
+            if(ep)
+                *ep = 0;
+            host = buf;
+        }
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(pn);
+        inet_pton(AF_INET6, host, &in6->sin6_addr);
+        return;
+    }
+#endif
+
+    struct sockaddr_in *in4 = (struct sockaddr_in *)addr;
+    in4->sin_family = AF_INET;
+    in4->sin_port = htons(pn);
+    if(host)
+        inet_pton(AF_INET, host, &in4->sin_addr);
+}
+
+static void peer(voip::msg_t msg, bool inbound, struct sockaddr_storage *addr)
+{
+    osip_via_t *via = NULL;
+    osip_generic_param_t *param = NULL;
+    const char *host = NULL, *port = NULL;
+
+    // a request arrives from and a response returns to its top via, while
+    // requests we send and responses to them go to the remote uri.
+
+    if(MSG_IS_REQUEST(msg) == inbound) {
+        osip_message_get_via(msg, 0, &via);
+        if(via) {
+            host = via->host;
+            port = via->port;
+            osip_via_param_get_byname(via, (char *)"received", &param);
+            if(param && param->gvalue)
+                host = param->gvalue;
+            param = NULL;
+            osip_via_param_get_byname(via, (char *)"rport", &param);
+            if(param && param->gvalue)
+                port = param->gvalue;
+        }
+    }
+    else if(MSG_IS_REQUEST(msg) && msg->req_uri) {
+        host = msg->req_uri->host;
+        port = msg->req_uri->port;
+    }
+    else if(msg->to && msg->to->url) {
+        host = msg->to->url->host;
+        port = msg->to->url->port;
+    }
+    inaddr(addr, host, port, 5060);
+}
+
+static uint16_t checksum(const uint8_t *hdr, size_t len)
+{
+    uint32_t sum = 0;
+
+    while(len > 1) {
+        sum += (hdr[0] << 8) | hdr[1];
+        hdr += 2;
+        len -= 2;
+    }
+    while(sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return htons((uint16_t)~sum);
+}
+
+#ifdef  AF_INET6
+// an ipv6 frame gives an ipv4 end its mapped address
+static void inaddr6(uint8_t *to, const struct sockaddr *addr)
+{
+    if(addr->sa_family == AF_INET6) {
+        memcpy(to, &((const struct sockaddr_in6 *)addr)->sin6_addr, 16);
+        return;
+    }
+    memset(to, 0, 10);
+    to[10] = to[11] = 0xff;
+    memcpy(to + 12, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+}
+#endif
+
+static size_t frame(uint8_t *hdr, const struct sockaddr *src, const struct sockaddr *dst, size_t size)
+{
+    size_t udplen = size + 8;
+    size_t iplen;
+    uint8_t *udp;
+
+#ifdef  AF_INET6
+    if(src->sa_family == AF_INET6 || dst->sa_family == AF_INET6) {
+        memset(hdr, 0, 40);
+        hdr[0] = 0x60;
+        hdr[4] = (uint8_t)(udplen >> 8);
+        hdr[5] = (uint8_t)(udplen & 0xff);
+        hdr[6] = IPPROTO_UDP;
+        hdr[7] = 64;
+        inaddr6(hdr + 8, src);
+        inaddr6(hdr + 24, dst);
+        iplen = 40;
+    }
+    else
+#endif
+    {
+        const struct sockaddr_in *s4 = (const struct sockaddr_in *)src;
+        const struct sockaddr_in *d4 = (const struct sockaddr_in *)dst;
+        size_t total = udplen + 20;
+        memset(hdr, 0, 20);
+        hdr[0] = 0x45;
+        hdr[2] = (uint8_t)(total >> 8);
+        hdr[3] = (uint8_t)(total & 0xff);
+        hdr[8] = 64;
+        hdr[9] = IPPROTO_UDP;
+        memcpy(hdr + 12, &s4->sin_addr, 4);
+        memcpy(hdr + 16, &d4->sin_addr, 4);
+        uint16_t sum = checksum(hdr, 20);
+        memcpy(hdr + 10, &sum, 2);
+        iplen = 20;
+    }
+
+    // udp checksum left zero; tools accept it as not computed
+    udp = hdr + iplen;
+    memcpy(udp, &((const struct sockaddr_in *)src)->sin_port, 2);
+    memcpy(udp + 2, &((const struct sockaddr_in *)dst)->sin_port, 2);
+    udp[4] = (uint8_t)(udplen >> 8);
+    udp[5] = (uint8_t)(udplen & 0xff);
+    udp[6] = udp[7] = 0;
+    return iplen + 8;
+}
+
+trace::trace() : DetachedThread()
+{
+}
+
+void trace::start(void)
+{
+    unsigned index;
+
+    for(index = 0; index < TRACE_RING; ++index) {
+        ring[index].sequence = index;
+        ring[index].msg = NULL;
+    }
+
+    stopping = false;
+    active = true;
+    writer = new trace();
+    writer->DetachedThread::start();
+}
+
+void trace::stop(void)
+{
+    unsigned tries = 20;
+
+    if(!writer)
+        return;
+
+    stopping = true;
+    while(active && tries--)
+        Thread::sleep(TRACE_PERIOD);
+}
+
+void trace::post(voip::msg_t msg, bool inbound)
+{
+    unsigned pos;
+    record_t *rec;
+    int diff;
+
+    if(!msg || !writer || stopping)
+        return;
+
+    pos = head;
+    for(;;) {
+        rec = &ring[pos % TRACE_RING];
+        diff = (int)(rec->sequence - pos);
+        if(!diff) {
+            if(TRACE_CAS(head, pos, pos + 1))
+                break;
+        }
+        else if(diff < 0) {
+            TRACE_INC(dropped);
+            return;
+        }
+        pos = head;
+    }
+
+    // the slot is ours; a message that cannot be cloned is passed to the
+    // writer empty so the ring keeps its order
+    rec->msg = NULL;
+    osip_message_clone(msg, &rec->msg);
+    rec->inbound = inbound;
+    gettimeofday(&rec->stamp, NULL);
+    MAPPED_BARRIER();
+    rec->sequence = pos + 1;
+}
+
+void trace::clear(void)
+{
+    char path[256];
+
+    String::set(path, sizeof(path), control::env("siplogs"));
+    String::add(path, sizeof(path), ".1");
+    ::remove(control::env("siplogs"));
+    ::remove(path);
+}
+
+static void replay(FILE *out, const char *path)
+{
+    pcap_file_t hdr;
+    pcap_record_t rec;
+    uint8_t packet[65536];
+    size_t offset;
+    char *cp, *tokens;
+
+    FILE *fp = fopen(path, "r");
+    if(!fp)
+        return;
+
+    if(fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != 0xa1b2c3d4) {
+        fclose(fp);
+        return;
+    }
+
+    while(fread(&rec, sizeof(rec), 1, fp) == 1) {
+        if(rec.captured >= sizeof(packet) || fread(packet, rec.captured, 1, fp) != 1)
+            break;
+        packet[rec.captured] = 0;
+        if((packet[0] >> 4) == 6)
+            offset = 48;
+        else
+            offset = (packet[0] & 0x0f) * 4 + 8;
+        if(offset >= rec.captured)
+            continue;
+        tokens = NULL;
+        while(NULL != (cp = String::token((char *)packet + offset, &tokens, "\n", NULL))) {
+            cp = String::strip(cp, " \t\r\n");
+            fprintf(out, "%s\n", cp);
+        }
+        fprintf(out, "---\n\n");
+    }
+    fclose(fp);
+}
+
+void trace::dump(FILE *out)
+{
+    assert(out != NULL);
+
+    char path[256];
+
+    // the rotated trace holds the older messages
+    String::set(path, sizeof(path), control::env("siplogs"));
+    String::add(path, sizeof(path), ".1");
+    replay(out, path);
+    replay(out, control::env("siplogs"));
+}
+
+void trace::snapshot(FILE *fp)
+{
+    assert(fp != NULL);
+
+    fprintf(fp, "  traced messages: %lu\n", (unsigned long)written);
+    fprintf(fp, "  dropped traces: %lu\n", (unsigned long)dropped);
+}
+
+void trace::run(void)
+{
+    shell::log(DEBUG1, "starting trace thread");
+
+    const char *path = control::env("siplogs");
+    char rotate[256];
+    uint8_t hdr[48];
+    struct sockaddr_storage local, remote;
+    const struct sockaddr *src, *dst;
+    char *text;
+    pcap_file_t file;
+    pcap_record_t info;
+    record_t *rec;
+    FILE *fp;
+    long size;
+    size_t len;
+
+    String::set(rotate, sizeof(rotate), path);
+    String::add(rotate, sizeof(rotate), ".1");
+
+    file.magic = 0xa1b2c3d4;
+    file.major = 2;
+    file.minor = 4;
+    file.zone = 0;
+    file.sigfigs = 0;
+    file.snaplen = 65535;
+    file.network = 101;     // raw ip
+
+    for(;;) {
+        rec = &ring[tail % TRACE_RING];
+        if(rec->sequence != tail + 1) {
+            if(stopping)
+                break;
+            Thread::sleep(TRACE_PERIOD);
+            continue;
+        }
+
+        inaddr(&local, service::getInterface(), NULL, service::getPort());
+        fp = fopen(path, "ab");
+        size = 0;
+        if(fp) {
+            fseek(fp, 0l, SEEK_END);
+            size = ftell(fp);
+            if(!size)
+                fwrite(&file, sizeof(file), 1, fp);
+        }
+
+        // one batch is whatever is ready now; the file is closed between
+        // batches so the trace may be cleared or rotated from outside.
+        while(rec->sequence == tail + 1) {
+            text = NULL;
+            len = 0;
+            if(fp && rec->msg)
+                osip_message_to_str(rec->msg, &text, &len);
+            if(text) {
+                if(len > TRACE_PAYLOAD)
+                    len = TRACE_PAYLOAD;
+                peer(rec->msg, rec->inbound, &remote);
+                if(rec->inbound) {
+                    src = (struct sockaddr *)&remote;
+                    dst = (struct sockaddr *)&local;
+                }
+                else {
+                    src = (struct sockaddr *)&local;
+                    dst = (struct sockaddr *)&remote;
+                }
+                size_t hlen = frame(hdr, src, dst, len);
+                info.seconds = rec->stamp.tv_sec;
+                info.micro = rec->stamp.tv_usec;
+                info.captured = info.length = (uint32_t)(hlen + len);
+                fwrite(&info, sizeof(info), 1, fp);
+                fwrite(hdr, hlen, 1, fp);
+                fwrite(text, len, 1, fp);
+                size += sizeof(info) + hlen + len;
+                ++written;
+                osip_free(text);
+            }
+            if(rec->msg)
+                osip_message_free(rec->msg);
+            rec->msg = NULL;
+            rec->sequence = tail + TRACE_RING;
+            rec = &ring[++tail % TRACE_RING];
+        }
+
+        if(fp) {
+            fclose(fp);
+            if(size > TRACE_LIMIT)
+                fsys::rename(path, rotate);
+        }
+    }
+
+    shell::log(DEBUG1, "stopping trace thread");
+    writer = NULL;
+    active = false;
+}
+
+} // end namespace
@@ -0,0 +1,84 @@
+// Copyright (C) 2015 Cherokees of Idaho.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef DEBUG
+#define DEBUG
+#endif
+
+#include "server.h"
+
+#include <stdio.h>
+
+using namespace SIPWITCH_NAMESPACE;
+
+static int redirect, operators, local, outside, star, exact;
+
+// the trie must agree with service::match, which accepts a pattern once
+// it is used up even if dialed digits are left over.
+static void check(dialplan *plan, const char *id, void *expected)
+{
+    assert(plan->find(id, 100) == expected);
+}
+
+extern "C" int main()
+{
+    dialplan *plan = new dialplan(16);
+    assert(plan != NULL);
+
+    plan->add("1xx", &redirect, 0, 1);
+    plan->add("9", &outside, 0, 2);
+    plan->add("0", &operators, 0, 3);
+    plan->add("5xxxxxx", &local, 0, 4);
+    plan->add("*7z", &star, 0, 5);
+    plan->identity("4000", &exact, 0, 6);
+    assert(plan->getCount() == 6);
+
+    // sample config redirect pattern with a longer dialed number
+    assert(service::match("1234", "1xx", false));
+    check(plan, "1234", &redirect);
+    check(plan, "123", &redirect);
+    check(plan, "12", NULL);
+
+    // a short prefix pattern routes everything behind it
+    check(plan, "95551234", &outside);
+    check(plan, "9", &outside);
+    check(plan, "0", &operators);
+    check(plan, "*75", &star);
+    check(plan, "*70", NULL);
+
+    check(plan, "5551234", &local);
+    check(plan, "55512345", &local);
+    check(plan, "555123", NULL);
+    check(plan, "4000", &exact);
+
+    // a later pattern ranks above an earlier one of the same priority
+    plan->add("95", &operators, 0, 8);
+    check(plan, "95551234", &operators);
+    plan->remove("95", &operators);
+
+    // a higher priority pattern wins whatever its order
+    plan->add("91", &operators, 1, 7);
+    check(plan, "915551234", &operators);
+    assert(plan->find("915551234", 1) == &outside);
+    plan->remove("91", &operators);
+    check(plan, "915551234", &outside);
+
+    plan->remove("9", &outside);
+    check(plan, "95551234", NULL);
+    assert(plan->getCount() == 5);
+
+    delete plan;
+    return 0;
+}
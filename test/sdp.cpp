@@ -0,0 +1,198 @@
+// Copyright (C) 2015 Cherokees of Idaho.
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef DEBUG
+#define DEBUG
+#endif
+
+#include "server.h"
+
+#include <stdio.h>
+
+using namespace SIPWITCH_NAMESPACE;
+
+#define HEADER  "v=0\r\no=- 1 1 IN IP4 10.0.0.1\r\ns=-\r\n"
+
+static LinkedObject *nat = NULL;
+static char sdpout[MAX_SDP_BUFFER];
+
+// the relay runs on 127.0.0.1 with pairs from port 20000; a released
+// pair goes back on the interface stack, so each case starts from 20000.
+static const char *rewrite(const char *sdpin)
+{
+    struct sockaddr_storage peering;
+    Socket::address addr("127.0.0.1");
+
+    media::release(&nat);
+    Socket::store(&peering, addr.getAddr());
+    media::sdp parser(sdpin, sdpout, sizeof(sdpout));
+    parser.peering = (struct sockaddr *)&peering;
+    parser.nat = &nat;
+    return parser.rewrite();
+}
+
+static unsigned count(void)
+{
+    unsigned total = 0;
+    linked_pointer<media::proxy> pp = nat;
+
+    while(is(pp)) {
+        ++total;
+        pp.next();
+    }
+    return total;
+}
+
+// the proxy on a port must relay to the given sdp endpoint
+static void check(unsigned short port, const char *host, unsigned short to)
+{
+    char text[64];
+    linked_pointer<media::proxy> pp = nat;
+
+    while(is(pp) && pp->port != port)
+        pp.next();
+
+    assert(is(pp));
+    Socket::query((struct sockaddr *)&pp->local, text, sizeof(text));
+    assert(!strcmp(text, host));
+    assert(ntohs(((struct sockaddr_in *)&pp->local)->sin_port) == to);
+}
+
+extern "C" int main()
+{
+    const char *out;
+
+    media::loopback(4, 1);
+
+    // session level c=, rtcp defaults to the port above rtp
+    out = rewrite(HEADER
+        "c=IN IP4 10.0.0.1\r\n"
+        "t=0 0\r\n"
+        "m=audio 4000 RTP/AVP 0\r\n");
+    assert(out != NULL);
+    assert(!strcmp(out, HEADER
+        "c=IN IP4 127.0.0.1\r\n"
+        "t=0 0\r\n"
+        "m=audio 20000 RTP/AVP 0\r\n"
+        "a=rtcp:20001 IN IP4 127.0.0.1\r\n"));
+    assert(count() == 2);
+    check(20000, "10.0.0.1", 4000);
+    check(20001, "10.0.0.1", 4001);
+
+    // media level c= overrides the session address for its stream only
+    out = rewrite(HEADER
+        "c=IN IP4 10.0.0.1\r\n"
+        "t=0 0\r\n"
+        "m=audio 4000 RTP/AVP 0\r\n"
+        "c=IN IP4 10.0.0.2\r\n"
+        "m=video 5000 RTP/AVP 31\r\n");
+    assert(out != NULL);
+    assert(!strcmp(out, HEADER
+        "c=IN IP4 127.0.0.1\r\n"
+        "t=0 0\r\n"
+        "m=audio 20000 RTP/AVP 0\r\n"
+        "c=IN IP4 127.0.0.1\r\n"
+        "a=rtcp:20001 IN IP4 127.0.0.1\r\n"
+        "m=video 20002 RTP/AVP 31\r\n"
+        "a=rtcp:20003 IN IP4 127.0.0.1\r\n"));
+    assert(count() == 4);
+    check(20000, "10.0.0.2", 4000);
+    check(20001, "10.0.0.2", 4001);
+    check(20002, "10.0.0.1", 5000);
+    check(20003, "10.0.0.1", 5001);
+
+    // a=rtcp without an address uses the stream's
+    out = rewrite(HEADER
+        "c=IN IP4 10.0.0.1\r\n"
+        "t=0 0\r\n"
+        "m=audio 4000 RTP/AVP 0\r\n"
+        "a=rtcp:4005\r\n"
+        "a=sendrecv\r\n");
+    assert(out != NULL);
+    assert(!strcmp(out, HEADER
+        "c=IN IP4 127.0.0.1\r\n"
+        "t=0 0\r\n"
+        "m=audio 20000 RTP/AVP 0\r\n"
+        "a=rtcp:20001 IN IP4 127.0.0.1\r\n"
+        "a=sendrecv\r\n"));
+    assert(count() == 2);
+    check(20000, "10.0.0.1", 4000);
+    check(20001, "10.0.0.1", 4005);
+
+    // a=rtcp with an address of its own
+    out = rewrite(HEADER
+        "c=IN IP4 10.0.0.1\r\n"
+        "t=0 0\r\n"
+        "m=audio 4000 RTP/AVP 0\r\n"
+        "a=rtcp:4005 IN IP4 10.0.0.3\r\n");
+    assert(out != NULL);
+    assert(!strcmp(out, HEADER
+        "c=IN IP4 127.0.0.1\r\n"
+        "t=0 0\r\n"
+        "m=audio 20000 RTP/AVP 0\r\n"
+        "a=rtcp:20001 IN IP4 127.0.0.1\r\n"));
+    check(20000, "10.0.0.1", 4000);
+    check(20001, "10.0.0.3", 4005);
+
+    // rtcp-mux shares the rtp proxy
+    out = rewrite(HEADER
+        "c=IN IP4 10.0.0.1\r\n"
+        "t=0 0\r\n"
+        "m=audio 4000 RTP/AVP 0\r\n"
+        "a=rtcp-mux\r\n");
+    assert(out != NULL);
+    assert(!strcmp(out, HEADER
+        "c=IN IP4 127.0.0.1\r\n"
+        "t=0 0\r\n"
+        "m=audio 20000 RTP/AVP 0\r\n"
+        "a=rtcp-mux\r\n"));
+    assert(count() == 1);
+    check(20000, "10.0.0.1", 4000);
+
+    // a disabled stream is passed through without a proxy
+    out = rewrite(HEADER
+        "c=IN IP4 10.0.0.1\r\n"
+        "t=0 0\r\n"
+        "m=video 0 RTP/AVP 31\r\n"
+        "m=audio 4000 RTP/AVP 0\r\n");
+    assert(out != NULL);
+    assert(!strcmp(out, HEADER
+        "c=IN IP4 127.0.0.1\r\n"
+        "t=0 0\r\n"
+        "m=video 0 RTP/AVP 31\r\n"
+        "m=audio 20000 RTP/AVP 0\r\n"
+        "a=rtcp:20001 IN IP4 127.0.0.1\r\n"));
+    assert(count() == 2);
+
+    // host names cannot be relayed to, at either level
+    assert(rewrite(HEADER
+        "c=IN IP4 media.example.com\r\n"
+        "t=0 0\r\n"
+        "m=audio 4000 RTP/AVP 0\r\n") == NULL);
+    assert(rewrite(HEADER
+        "t=0 0\r\n"
+        "m=audio 4000 RTP/AVP 0\r\n"
+        "c=IN IP4 media.example.com\r\n") == NULL);
+
+    // multiple ports per stream cannot be relayed
+    assert(rewrite(HEADER
+        "c=IN IP4 10.0.0.1\r\n"
+        "t=0 0\r\n"
+        "m=video 5000/2 RTP/AVP 31\r\n") == NULL);
+
+    media::release(&nat);
+    media::shutdown();
+    return 0;
+}
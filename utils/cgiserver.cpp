@@ -1044,7 +1044,8 @@ static void call_instance(void)
 
     time(&now);
     while(index < count) {
-        cr.copy(index++, map);
+        if(!mapped_copy(cr(index++), map))
+            continue;
         if(!map.created)
             continue;
 
@@ -1086,7 +1087,8 @@ static void call_range(void)
     response(buffer, size, "^[");
 
     while(index < count) {
-        cr.copy(index++, map);
+        if(!mapped_copy(cr(index++), map))
+            continue;
 
         if(!map.created)
             continue;
@@ -1218,7 +1220,8 @@ static void user_instance(void)
 
     time(&now);
     while(index < count) {
-        reg.copy(index++, map);
+        if(!mapped_copy(reg(index++), map))
+            continue;
 
         if(map.type != MappedRegistry::USER && map.type != MappedRegistry::SERVICE)
             continue;
@@ -1281,7 +1284,8 @@ static void user_range(void)
     time(&now);
 
     while(index < count) {
-        reg.copy(index++, map);
+        if(!mapped_copy(reg(index++), map))
+            continue;
 
         if(map.type != MappedRegistry::USER && map.type != MappedRegistry::SERVICE)
             continue;
@@ -1670,7 +1674,8 @@ static void dumpcalls(const char *id)
     time(&now);
 
     while(index < count) {
-        calls.copy(index++, buffer);
+        if(!mapped_copy(calls(index++), buffer))
+            continue;
         if(!buffer.created)
             continue;
 
@@ -1761,7 +1766,8 @@ static void registry(const char *id)
     printf("<mappedRegistry>\n");
     time(&now);
     while(index < count) {
-        reg.copy(index++, buffer);
+        if(!mapped_copy(reg(index++), buffer))
+            continue;
         if(buffer.type == MappedRegistry::EXPIRED)
             continue;
         else if(buffer.type == MappedRegistry::TEMPORARY && !buffer.inuse)
@@ -36,6 +36,7 @@ using namespace sipwitch;
 static string_t statmap = STAT_MAP;
 static string_t callmap = CALL_MAP;
 static string_t regmap = REGISTRY_MAP;
+static string_t latencymap = LATENCY_MAP;
 
 #ifdef  _MSWINDOWS_
 static char *getpass(const char *prompt)
@@ -142,6 +143,7 @@ static void mapinit(void)
         statmap = str(STAT_MAP "-") + str(userid);
         callmap = str(CALL_MAP "-") + str(userid);
         regmap = str(REGISTRY_MAP "-") + str(userid);
+        latencymap = str(LATENCY_MAP "-") + str(userid);
     }
     else
         ::close(fd);
@@ -354,7 +356,7 @@ static void calls(char **argv)
     mapped_view<MappedCall> calls(*callmap);
     unsigned count = calls.count();
     unsigned index = 0;
-    const volatile MappedCall *map;
+    MappedCall buffer;
     time_t now;
 
     if(!count)
@@ -362,15 +364,16 @@ static void calls(char **argv)
 
     time(&now);
     while(index < count) {
-        map = (const volatile MappedCall *)(calls(index++));
+        if(!mapped_copy(calls(index++), buffer))
+            continue;
 
-        if(!map->created || !map->source[0])
+        if(!buffer.created || !buffer.source[0])
             continue;
 
-        if(map->active)
-            printf("%08x:%d %s %s \"%s\" -> %s; %ld sec(s)\n", map->sequence, map->cid, map->state + 1, map->source, map->display, map->target, (long)(now - map->active));
+        if(buffer.active)
+            printf("%08x:%d %s %s \"%s\" -> %s; %ld sec(s)\n", buffer.sequence, buffer.cid, buffer.state + 1, buffer.source, buffer.display, buffer.target, (long)(now - buffer.active));
         else
-            printf("%08x:%d %s %s \"%s\" -> none; %ld secs\n", map->sequence, map->cid, map->state + 1, map->source, map->display, (long)(now - map->created));
+            printf("%08x:%d %s %s \"%s\" -> none; %ld secs\n", buffer.sequence, buffer.cid, buffer.state + 1, buffer.source, buffer.display, (long)(now - buffer.created));
     }
     exit(0);
 }
@@ -605,6 +608,47 @@ static void dumpstats(char **argv)
     exit(0);
 }
 
+static unsigned long percentile(const MappedLatency& map, unsigned pct)
+{
+    unsigned long want = (map.count * pct + 99) / 100;
+    unsigned long seen = 0;
+
+    for(unsigned index = 0; index < LATENCY_BUCKETS; ++index) {
+        seen += map.buckets[index];
+        if(seen >= want)
+            return MappedLatency::floor(index);
+    }
+    return map.max;
+}
+
+static void latency(char **argv)
+{
+    if(argv[1])
+        shell::errexit(1, "*** sipcontrol: latency: no arguments used\n");
+
+    mapinit();
+
+    mapped_view<MappedLatency> lat(*latencymap);
+    unsigned count = lat.count();
+    unsigned index = 0;
+    MappedLatency map;
+
+    if(!count)
+        shell::errexit(10, "*** sipcontrol: latency: offline\n");
+
+    printf("%-20s %9s %8s %8s %8s %8s %8s\n", "usec", "count", "mean", "p50", "p90", "p99", "max");
+    while(index < count) {
+        lat.copy(index++, map);
+        if(!map.id[0] || !map.count)
+            continue;
+
+        printf("%-20s %09lu %08lu %08lu %08lu %08lu %08lu\n", map.id, map.count,
+            (unsigned long)(map.total / map.count),
+            percentile(map, 50), percentile(map, 90), percentile(map, 99), map.max);
+    }
+    exit(0);
+}
+
 static void registry(char **argv)
 {
     mapinit();
@@ -625,7 +669,8 @@ static void registry(char **argv)
 
     time(&now);
     while(index < count) {
-        reg.copy(index++, buffer);
+        if(!mapped_copy(reg(index++), buffer))
+            continue;
         if(buffer.type == MappedRegistry::EXPIRED)
             continue;
         else if(buffer.type == MappedRegistry::TEMPORARY && !buffer.inuse)
@@ -780,6 +825,7 @@ static void usage(void)
         "  history [bufsize]        Set buffer or dump error log\n"
         "  ifup <iface>             Notify interface came up\n"
         "  ifdown <iface>           Notify interface went down\n"
+        "  latency                  Dump event and lock latencies\n"
         "  message <ext> <text>     Send text message to extension\n"
         "  peering                  Print peering (published) address\n"
         "  period <interval>        Collect periodic statistics\n"
@@ -1034,6 +1080,8 @@ PROGRAM_MAIN(argc, argv)
         registry(argv);
     else if(eq(*argv, "stats"))
         dumpstats(argv);
+    else if(eq(*argv, "latency"))
+        latency(argv);
     else if(eq(*argv, "calls"))
         calls(argv);
     else if(eq(*argv, "digest"))